@@ -0,0 +1,509 @@
+/*
+ * dfubench.c
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * Non-interactive throughput and latency benchmark of /dev/dfu?, run on
+ * one thread per device at once
+ *
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "usbdfu_ioctl.h"
+
+#define BENCH_OPEN	0x01
+#define BENCH_WRITE	0x02
+#define BENCH_READ	0x04
+#define BENCH_FLASH	0x08
+#define BENCH_COMMIT	0x10
+#define BENCH_SPLICE	0x20
+
+struct samples {
+	double *us;
+	size_t n, max;
+};
+
+struct bench {
+	const char *devname;
+	pthread_t thread;
+	int err;
+	struct samples open, close, wblk, rblk, flash;
+	unsigned long long wbytes, rbytes, fbytes, sbytes;
+	double wus, rus, fus, sus;
+};
+
+static size_t img_size = 64 * 1024;
+static size_t blksize;
+static int iters = 3;
+static int nopens = 20;
+static int modes = BENCH_OPEN | BENCH_WRITE | BENCH_READ;
+static int raw;
+static unsigned char *image;
+static pthread_barrier_t start;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_sample(struct samples *s, double us)
+{
+	double *nus;
+
+	if (s->n == s->max) {
+		s->max = s->max ? 2 * s->max : 256;
+		nus = realloc(s->us, s->max * sizeof(double));
+		if (!nus) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		s->us = nus;
+	}
+	s->us[s->n++] = us;
+}
+
+static void merge_samples(struct samples *to, const struct samples *from)
+{
+	size_t i;
+
+	for (i = 0; i < from->n; i++)
+		add_sample(to, from->us[i]);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pctl(const struct samples *s, int pct)
+{
+	size_t i;
+
+	i = (s->n * pct + 99) / 100;
+	return s->us[i ? i - 1 : 0];
+}
+
+static void print_lat(const char *dev, const char *what, struct samples *s)
+{
+	if (s->n == 0)
+		return;
+	qsort(s->us, s->n, sizeof(double), cmp_double);
+	printf("%-12s %-6s lat n %zu p50 %.0f p90 %.0f p99 %.0f max %.0f us\n",
+		dev, what, s->n, pctl(s, 50), pctl(s, 90), pctl(s, 99),
+		s->us[s->n - 1]);
+}
+
+static void print_rate(const char *dev, const char *what,
+			unsigned long long bytes, double us)
+{
+	if (bytes == 0)
+		return;
+	printf("%-12s %-6s %llu bytes in %.1f ms, %.3f MB/s\n", dev, what,
+		bytes, us / 1e3, bytes / us);
+}
+
+static int bench_open(struct bench *b)
+{
+	double t0, t1;
+	int i, fd;
+
+	for (i = 0; i < nopens; i++) {
+		t0 = now_us();
+		fd = open(b->devname, O_RDWR);
+		if (fd < 0)
+			return -errno;
+		t1 = now_us();
+		close(fd);
+		add_sample(&b->open, t1 - t0);
+		add_sample(&b->close, now_us() - t1);
+	}
+	return 0;
+}
+
+/* one write() per block, each a DNLOAD and the GETSTATUS polls after it */
+static int bench_write(struct bench *b)
+{
+	double t0, t1, tb;
+	size_t pos, len;
+	ssize_t numb;
+	int fd;
+
+	t0 = now_us();
+	fd = open(b->devname, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	for (pos = 0; pos < img_size; pos += numb) {
+		len = img_size - pos < blksize ? img_size - pos : blksize;
+		tb = now_us();
+		numb = write(fd, image + pos, len);
+		if (numb <= 0) {
+			close(fd);
+			return numb < 0 ? -errno : -EIO;
+		}
+		add_sample(&b->wblk, now_us() - tb);
+	}
+	t1 = now_us();
+	close(fd);
+	add_sample(&b->close, now_us() - t1);
+	b->wbytes += img_size;
+	b->wus += now_us() - t0;
+	return 0;
+}
+
+static int bench_read(struct bench *b, unsigned char *buf, size_t *rlen)
+{
+	double t0, tb;
+	size_t pos;
+	ssize_t numb;
+	int fd;
+
+	t0 = now_us();
+	fd = open(b->devname, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	for (pos = 0; pos < img_size; pos += numb) {
+		tb = now_us();
+		numb = read(fd, buf + pos, blksize);
+		if (numb < 0) {
+			close(fd);
+			return -errno;
+		}
+		if (numb == 0)
+			break;
+		add_sample(&b->rblk, now_us() - tb);
+	}
+	close(fd);
+	*rlen = pos;
+	b->rbytes += pos;
+	b->rus += now_us() - t0;
+	return 0;
+}
+
+/*
+ * splice() the upload through a pipe, in requests that end off a block
+ * boundary whenever the image size does, and check it against what
+ * read() got into @buf
+ */
+static int bench_splice(struct bench *b, unsigned char *buf, size_t rlen)
+{
+	unsigned char *sbuf;
+	double t0;
+	size_t pos, got;
+	ssize_t numb, n;
+	int fd, pfd[2], retv;
+
+	sbuf = malloc(img_size);
+	if (!sbuf)
+		return -ENOMEM;
+	retv = 0;
+	if (pipe(pfd)) {
+		retv = -errno;
+		goto exit_10;
+	}
+	t0 = now_us();
+	fd = open(b->devname, O_RDONLY);
+	if (fd < 0) {
+		retv = -errno;
+		goto exit_20;
+	}
+	for (pos = 0; pos < img_size; pos += numb) {
+		numb = splice(fd, NULL, pfd[1], NULL, img_size - pos, 0);
+		if (numb < 0)
+			retv = -errno;
+		if (numb <= 0)
+			break;
+		for (got = 0; got < (size_t)numb; got += n) {
+			n = read(pfd[0], sbuf + pos + got, numb - got);
+			if (n <= 0) {
+				retv = -EIO;
+				break;
+			}
+		}
+		if (retv)
+			break;
+	}
+	close(fd);
+	b->sbytes += pos;
+	b->sus += now_us() - t0;
+	if (rlen > img_size)
+		rlen = img_size;
+	if (retv == 0 && (pos != rlen || memcmp(sbuf, buf, pos)))
+		retv = -EIO;
+exit_20:
+	close(pfd[0]);
+	close(pfd[1]);
+exit_10:
+	free(sbuf);
+	return retv;
+}
+
+static int bench_flash(struct bench *b)
+{
+	struct dfu_flash flash;
+	double t0;
+	int fd, retv;
+
+	fd = open(b->devname, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	memset(&flash, 0, sizeof(flash));
+	flash.image = (unsigned long)image;
+	flash.len = img_size;
+	flash.flags = DFU_FLASH_MANIFEST;
+	t0 = now_us();
+	retv = ioctl(fd, DFU_IOC_FLASH, &flash);
+	if (retv == 0) {
+		add_sample(&b->flash, now_us() - t0);
+		b->fbytes += img_size;
+		b->fus += now_us() - t0;
+	} else
+		retv = -errno;
+	close(fd);
+	return retv;
+}
+
+/* fill the mmap() staging area and flash it with DFU_IOC_COMMIT */
+static int bench_commit(struct bench *b)
+{
+	struct dfu_flash flash;
+	unsigned char *stage;
+	double t0;
+	int fd, retv;
+
+	fd = open(b->devname, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	t0 = now_us();
+	stage = mmap(NULL, img_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0);
+	if (stage == MAP_FAILED) {
+		retv = -errno;
+		close(fd);
+		return retv;
+	}
+	memcpy(stage, image, img_size);
+	memset(&flash, 0, sizeof(flash));
+	flash.len = img_size;
+	flash.flags = DFU_FLASH_MANIFEST;
+	retv = ioctl(fd, DFU_IOC_COMMIT, &flash);
+	if (retv == 0) {
+		add_sample(&b->flash, now_us() - t0);
+		b->fbytes += img_size;
+		b->fus += now_us() - t0;
+	} else
+		retv = -errno;
+	munmap(stage, img_size);
+	close(fd);
+	return retv;
+}
+
+static void *bench_run(void *arg)
+{
+	struct bench *b = arg;
+	unsigned char *buf;
+	size_t rlen = 0;
+	int i;
+
+	buf = malloc(img_size + blksize);
+	if (!buf) {
+		b->err = -ENOMEM;
+		return NULL;
+	}
+	pthread_barrier_wait(&start);
+	if (modes & BENCH_OPEN)
+		b->err = bench_open(b);
+	for (i = 0; i < iters && b->err == 0; i++) {
+		if (modes & BENCH_WRITE)
+			b->err = bench_write(b);
+		if (b->err == 0 && (modes & (BENCH_READ | BENCH_SPLICE)))
+			b->err = bench_read(b, buf, &rlen);
+		if (b->err == 0 && (modes & BENCH_SPLICE))
+			b->err = bench_splice(b, buf, rlen);
+		if (b->err == 0 && (modes & BENCH_FLASH))
+			b->err = bench_flash(b);
+		if (b->err == 0 && (modes & BENCH_COMMIT))
+			b->err = bench_commit(b);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* the transfer size dfusb1 uses, from the interface's sysfs files */
+static size_t dev_xfersize(const char *devname)
+{
+	const char *base;
+	char path[256];
+	FILE *fp;
+	unsigned int size = 0;
+
+	base = strrchr(devname, '/');
+	base = base ? base + 1 : devname;
+	snprintf(path, sizeof(path), "/sys/class/dfu/%s/device/xfersize",
+			base);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%u", &size) != 1)
+		size = 0;
+	fclose(fp);
+	return size;
+}
+
+static int parse_modes(const char *arg)
+{
+	int m = 0;
+
+	if (strstr(arg, "open"))
+		m |= BENCH_OPEN;
+	if (strstr(arg, "write"))
+		m |= BENCH_WRITE;
+	if (strstr(arg, "read"))
+		m |= BENCH_READ;
+	if (strstr(arg, "flash"))
+		m |= BENCH_FLASH;
+	if (strstr(arg, "commit"))
+		m |= BENCH_COMMIT;
+	if (strstr(arg, "splice"))
+		m |= BENCH_SPLICE;
+	return m;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s size] [-b block] [-i iterations] "
+		"[-o opens] [-m open,write,read,flash,commit,splice] [-r] "
+		"/dev/dfuN ...\n"
+		"  -r  plain image, without the Tiva program header\n", prog);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench *benches, all;
+	double t0, wall;
+	int i, opt, ndevs, fails;
+	size_t pos;
+
+	while ((opt = getopt(argc, argv, "s:b:i:o:m:r")) != -1) {
+		switch (opt) {
+		case 's':
+			img_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			blksize = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			iters = atoi(optarg);
+			break;
+		case 'o':
+			nopens = atoi(optarg);
+			break;
+		case 'm':
+			modes = parse_modes(optarg);
+			break;
+		case 'r':
+			raw = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	ndevs = argc - optind;
+	if (ndevs <= 0 || img_size <= 8 || modes == 0)
+		usage(argv[0]);
+	if (blksize == 0)
+		blksize = dev_xfersize(argv[optind]);
+	if (blksize == 0)
+		blksize = 1024;
+
+	image = malloc(img_size);
+	benches = calloc(ndevs, sizeof(struct bench));
+	if (!image || !benches) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	for (pos = 0; pos < img_size; pos++)
+		image[pos] = rand();
+	if (!raw) {
+		/* program the image from flash block 0 */
+		memset(image, 0, 8);
+		image[0] = 0x01;
+		image[4] = (img_size - 8) & 0xff;
+		image[5] = ((img_size - 8) >> 8) & 0xff;
+		image[6] = ((img_size - 8) >> 16) & 0xff;
+		image[7] = ((img_size - 8) >> 24) & 0xff;
+	}
+
+	pthread_barrier_init(&start, NULL, ndevs + 1);
+	for (i = 0; i < ndevs; i++) {
+		benches[i].devname = argv[optind + i];
+		if (pthread_create(&benches[i].thread, NULL, bench_run,
+					&benches[i])) {
+			fprintf(stderr, "Cannot start thread\n");
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&start);
+	t0 = now_us();
+	for (i = 0; i < ndevs; i++)
+		pthread_join(benches[i].thread, NULL);
+	wall = now_us() - t0;
+
+	printf("devices %d image %zu block %zu iterations %d\n", ndevs,
+		img_size, blksize, iters);
+	memset(&all, 0, sizeof(all));
+	fails = 0;
+	for (i = 0; i < ndevs; i++) {
+		struct bench *b = &benches[i];
+		const char *name = strrchr(b->devname, '/');
+
+		name = name ? name + 1 : b->devname;
+		if (b->err) {
+			printf("%-12s failed: %s\n", name, strerror(-b->err));
+			fails++;
+		}
+		print_rate(name, "write", b->wbytes, b->wus);
+		print_rate(name, "read", b->rbytes, b->rus);
+		print_rate(name, "splice", b->sbytes, b->sus);
+		print_rate(name, "flash", b->fbytes, b->fus);
+		print_lat(name, "wblk", &b->wblk);
+		print_lat(name, "rblk", &b->rblk);
+		print_lat(name, "open", &b->open);
+		print_lat(name, "close", &b->close);
+		print_lat(name, "flash", &b->flash);
+		merge_samples(&all.wblk, &b->wblk);
+		merge_samples(&all.rblk, &b->rblk);
+		merge_samples(&all.open, &b->open);
+		merge_samples(&all.close, &b->close);
+		all.wbytes += b->wbytes;
+		all.rbytes += b->rbytes;
+		all.sbytes += b->sbytes;
+		all.fbytes += b->fbytes;
+	}
+	if (ndevs > 1) {
+		print_rate("all", "total", all.wbytes + all.rbytes +
+				all.sbytes + all.fbytes, wall);
+		print_lat("all", "wblk", &all.wblk);
+		print_lat("all", "rblk", &all.rblk);
+		print_lat("all", "open", &all.open);
+		print_lat("all", "close", &all.close);
+	}
+	return fails ? 1 : 0;
+}
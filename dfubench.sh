@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# dfubench.sh [ndevs [dfubench options]]
+#
+# Bring up ndevs emulated Tiva DFU devices on dummy_hcd, run dfubench on
+# all of them and tear them down again. Needs root, libcomposite and
+# dummy_hcd. Emulator parameters come from the environment, as
+# DFUEMU_XFERSIZE, DFUEMU_POLL_MS, DFUEMU_MANIFEST_MS, DFUEMU_FAIL_EVERY,
+# DFUEMU_FAIL_STATUS, DFUEMU_STALL_EVERY, DFUEMU_FLASH_KB, DFUEMU_TIVA
+# and DFUEMU_ATTRIBUTES.
+#
+NDEVS=${1:-1}
+[ $# -gt 0 ] && shift
+GADGETS=/sys/kernel/config/usb_gadget
+PARAMS="xfersize attributes poll_ms manifest_ms flash_kb fail_every \
+	fail_status stall_every tiva"
+
+teardown()
+{
+	set +e
+	for g in $GADGETS/dfuemu*; do
+		[ -d "$g" ] || continue
+		echo "" > $g/UDC 2>/dev/null
+		rm -f $g/configs/c.1/dfuemu.0
+		rmdir $g/configs/c.1/strings/0x409 $g/configs/c.1 \
+			$g/functions/dfuemu.0 $g/strings/0x409 $g
+	done
+	rmmod dfusb1 dfuemu 2>/dev/null
+}
+
+set -e
+modprobe libcomposite
+modprobe dummy_hcd num=$NDEVS
+insmod ./dfuemu.ko
+insmod ./dfusb1.ko
+trap teardown EXIT
+
+udcs=$(ls /sys/class/udc | grep dummy_udc | head -n $NDEVS)
+i=0
+for udc in $udcs; do
+	g=$GADGETS/dfuemu$i
+	mkdir $g
+	echo 0x1cbe > $g/idVendor
+	echo 0x00ff > $g/idProduct
+	echo 0x0200 > $g/bcdUSB
+	mkdir $g/strings/0x409
+	echo "dfuemu$i" > $g/strings/0x409/serialnumber
+	echo "Texas Instruments" > $g/strings/0x409/manufacturer
+	echo "Device Firmware Upgrade" > $g/strings/0x409/product
+	mkdir $g/functions/dfuemu.0
+	for p in $PARAMS; do
+		v=$(eval echo \$DFUEMU_$(echo $p | tr a-z A-Z))
+		[ -n "$v" ] && echo $v > $g/functions/dfuemu.0/$p
+	done
+	mkdir $g/configs/c.1
+	mkdir $g/configs/c.1/strings/0x409
+	echo "DFU" > $g/configs/c.1/strings/0x409/configuration
+	ln -s $g/functions/dfuemu.0 $g/configs/c.1/
+	echo $udc > $g/UDC
+	i=$((i + 1))
+done
+
+tries=0
+while [ $(ls /dev/dfu[0-9]* 2>/dev/null | wc -l) -lt $NDEVS ]; do
+	tries=$((tries + 1))
+	if [ $tries -gt 50 ]; then
+		echo "Only $(ls /dev/dfu[0-9]* 2>/dev/null | wc -l) of" \
+			"$NDEVS devices came up" >&2
+		exit 1
+	fi
+	sleep 0.2
+done
+
+rc=0
+./dfubench "$@" $(ls /dev/dfu[0-9]*) || rc=$?
+exit $rc
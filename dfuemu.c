@@ -0,0 +1,646 @@
+/*
+ * dfuemu.c
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * USB gadget function emulating a Tiva/Stellaris boot loader in DFU mode,
+ * for benchmarking dfusb1 over dummy_hcd without real boards
+ *
+*/
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/usb/composite.h>
+#include "usbdfu.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Dashi Cao");
+MODULE_DESCRIPTION("USB DFU Device Emulator Gadget Function");
+
+#define DFU_ERR_FILE		0x02
+#define DFU_ERR_WRITE		0x03
+#define DFU_ERR_CHECK_ERASED	0x05
+#define DFU_ERR_ADDRESS		0x08
+#define DFU_ERR_NOTDONE		0x09
+#define DFU_ERR_UNKNOWN		0x0e
+#define DFU_ERR_STALLEDPKT	0x0f
+
+#define TIVA_BLKSIZE		1024
+#define TIVA_PROG		0x01
+#define TIVA_READ		0x02
+#define TIVA_CHECK		0x03
+#define TIVA_ERASE		0x04
+#define TIVA_INFO		0x05
+#define TIVA_BIN		0x06
+#define TIVA_RESET		0x07
+#define TIVA_REQUEST		0x42	/* the Luminary marker request */
+
+struct tiva_cmd {
+	u8 cmd;
+	u8 arg8;
+	__le16 addr;
+	__le32 arg32;
+} __packed;
+
+struct tiva_info {
+	__le16 usFlashBlockSize;
+	__le16 usNumFlashBlocks;
+	__le32 ulPartInfo;
+	__le32 ulClassInfo;
+	__le32 ulFlashTop;
+	__le32 ulAppStartAddr;
+} __packed;
+
+struct f_dfuemu_opts {
+	struct usb_function_instance func_inst;
+	struct mutex lock;
+	int refcnt;
+	u32 xfersize;
+	u32 attributes;
+	u32 poll_ms;
+	u32 manifest_ms;
+	u32 flash_kb;
+	u32 fail_every;
+	u32 fail_status;
+	u32 stall_every;
+	u32 tiva;
+};
+
+struct f_dfuemu {
+	struct usb_function function;
+	struct usb_interface_descriptor intf_desc;
+	struct dfufdsc fdsc;
+	struct usb_descriptor_header *descs[3];
+	u32 xfersize, attributes, poll_ms, manifest_ms;
+	u32 fail_every, fail_status, stall_every, tiva;
+
+	spinlock_t lock;
+	u8 *flash;
+	u32 flash_size;
+	u8 intf;
+	u8 state, status;
+	u8 next;		/* state to reach once a DNLOAD is done */
+	u8 bin, info, hdr, rset;
+	u32 wptr, wend;
+	u32 rptr, rend;
+	ktime_t ready;		/* end of dfuDNBUSY or dfuMANIFEST */
+	u32 ndnload, nreq;
+};
+
+static inline struct f_dfuemu *func_to_emu(struct usb_function *f)
+{
+	return container_of(f, struct f_dfuemu, function);
+}
+
+static int emu_error(struct f_dfuemu *emu, u8 status)
+{
+	emu->state = dfuERROR;
+	emu->status = status;
+	return -EOPNOTSUPP;
+}
+
+static void emu_reset(struct f_dfuemu *emu)
+{
+	emu->state = dfuIDLE;
+	emu->status = 0;
+	emu->info = 0;
+	emu->hdr = 0;
+	emu->rset = 0;
+}
+
+static int emu_tiva_cmd(struct f_dfuemu *emu, const u8 *buf, unsigned int len)
+{
+	const struct tiva_cmd *cmd = (const struct tiva_cmd *)buf;
+	u32 addr, arg32;
+	unsigned int i;
+
+	if (len < sizeof(*cmd))
+		return emu_error(emu, DFU_ERR_FILE);
+	addr = le16_to_cpu(cmd->addr) * TIVA_BLKSIZE;
+	arg32 = le32_to_cpu(cmd->arg32);
+	emu->next = dfuIDLE;
+	switch (cmd->cmd) {
+	case TIVA_PROG:
+		if (addr > emu->flash_size || arg32 > emu->flash_size - addr)
+			return emu_error(emu, DFU_ERR_ADDRESS);
+		emu->wptr = addr;
+		emu->wend = addr + arg32;
+		emu->next = dfuDNLOAD_IDLE;
+		return sizeof(*cmd);
+	case TIVA_READ:
+	case TIVA_CHECK:
+		if (addr > emu->flash_size || arg32 > emu->flash_size - addr)
+			return emu_error(emu, DFU_ERR_ADDRESS);
+		if (cmd->cmd == TIVA_CHECK) {
+			for (i = 0; i < arg32; i++)
+				if (emu->flash[addr + i] != 0xff)
+					return emu_error(emu,
+						DFU_ERR_CHECK_ERASED);
+			break;
+		}
+		emu->rptr = addr;
+		emu->rend = addr + arg32;
+		emu->rset = 1;
+		break;
+	case TIVA_ERASE:
+		arg32 = (arg32 & 0xffff) * TIVA_BLKSIZE;
+		if (addr > emu->flash_size || arg32 > emu->flash_size - addr)
+			return emu_error(emu, DFU_ERR_ADDRESS);
+		memset(emu->flash + addr, 0xff, arg32);
+		break;
+	case TIVA_INFO:
+		emu->info = 1;
+		break;
+	case TIVA_BIN:
+		emu->bin = cmd->arg8 ? 1 : 0;
+		break;
+	case TIVA_RESET:
+		break;
+	default:
+		return emu_error(emu, DFU_ERR_FILE);
+	}
+	return len;
+}
+
+/* a DNLOAD data stage has arrived, called with emu->lock held */
+static void emu_dnload(struct f_dfuemu *emu, const u8 *buf, unsigned int len)
+{
+	int used;
+
+	emu->ndnload++;
+	if (emu->fail_every && emu->ndnload % emu->fail_every == 0) {
+		emu_error(emu, emu->fail_status);
+		return;
+	}
+	if (emu->state == dfuIDLE) {
+		emu->wptr = 0;
+		emu->wend = emu->flash_size;
+		emu->next = dfuDNLOAD_IDLE;
+		if (emu->tiva) {
+			used = emu_tiva_cmd(emu, buf, len);
+			if (used < 0)
+				return;
+			buf += used;
+			len -= used;
+		}
+	}
+	if (len > emu->wend - emu->wptr) {
+		emu_error(emu, DFU_ERR_ADDRESS);
+		return;
+	}
+	memcpy(emu->flash + emu->wptr, buf, len);
+	emu->wptr += len;
+	emu->state = dfuDNLOAD_SYNC;
+}
+
+static void emu_dnload_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct f_dfuemu *emu = req->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	if (req->status || req->actual != req->length)
+		emu_error(emu, DFU_ERR_UNKNOWN);
+	else
+		emu_dnload(emu, req->buf, req->actual);
+	spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+static int emu_upload(struct f_dfuemu *emu, u8 *buf, unsigned int len)
+{
+	struct tiva_cmd *hdr;
+	struct tiva_info *info;
+	unsigned int numb, pos;
+
+	if (emu->state == dfuIDLE) {
+		if (emu->info) {
+			emu->info = 0;
+			info = (struct tiva_info *)buf;
+			numb = min_t(unsigned int, len, sizeof(*info));
+			info->usFlashBlockSize = cpu_to_le16(TIVA_BLKSIZE);
+			info->usNumFlashBlocks =
+				cpu_to_le16(emu->flash_size / TIVA_BLKSIZE);
+			info->ulPartInfo = cpu_to_le32(0x10a1);
+			info->ulClassInfo = cpu_to_le32(0x00050000);
+			info->ulFlashTop = cpu_to_le32(emu->flash_size);
+			info->ulAppStartAddr = 0;
+			return numb;
+		}
+		if (!emu->rset) {
+			emu->rptr = 0;
+			emu->rend = emu->flash_size;
+		}
+		emu->rset = 0;
+		emu->hdr = emu->tiva && !emu->bin;
+	}
+	pos = 0;
+	if (emu->hdr && len >= sizeof(*hdr)) {
+		emu->hdr = 0;
+		hdr = (struct tiva_cmd *)buf;
+		hdr->cmd = TIVA_PROG;
+		hdr->arg8 = 0;
+		hdr->addr = cpu_to_le16(emu->rptr / TIVA_BLKSIZE);
+		hdr->arg32 = cpu_to_le32(emu->rend - emu->rptr);
+		pos = sizeof(*hdr);
+	}
+	numb = min(len - pos, emu->rend - emu->rptr);
+	memcpy(buf + pos, emu->flash + emu->rptr, numb);
+	emu->rptr += numb;
+	pos += numb;
+	emu->state = pos < len ? dfuIDLE : dfuUPLOAD_IDLE;
+	return pos;
+}
+
+static u32 emu_left_ms(struct f_dfuemu *emu)
+{
+	s64 left = ktime_ms_delta(emu->ready, ktime_get());
+
+	return left > 0 ? left : 0;
+}
+
+static int emu_getstatus(struct f_dfuemu *emu, u8 *buf)
+{
+	struct dfu_status *st = (struct dfu_status *)buf;
+	u32 tmout = 0;
+
+	switch (emu->state) {
+	case dfuDNLOAD_SYNC:
+		if (emu->poll_ms) {
+			emu->state = dfuDNLOAD_BUSY;
+			emu->ready = ktime_add_ms(ktime_get(), emu->poll_ms);
+			tmout = emu->poll_ms;
+		} else
+			emu->state = emu->next;
+		break;
+	case dfuDNLOAD_BUSY:
+		tmout = emu_left_ms(emu);
+		if (tmout == 0)
+			emu->state = emu->next;
+		break;
+	case dfuMANIFEST_SYNC:
+		if (emu->manifest_ms) {
+			emu->state = dfuMANIFEST;
+			emu->ready = ktime_add_ms(ktime_get(),
+						emu->manifest_ms);
+			tmout = emu->manifest_ms;
+			break;
+		}
+		/* fall through */
+	case dfuMANIFEST:
+		if (emu->state == dfuMANIFEST)
+			tmout = emu_left_ms(emu);
+		if (tmout == 0)
+			emu->state = (emu->attributes & 0x04) ? dfuIDLE :
+					dfuMANIFEST_WAIT_RESET;
+		break;
+	}
+	st->bStatus = emu->status;
+	st->wmsec[0] = tmout & 0xff;
+	st->wmsec[1] = (tmout >> 8) & 0xff;
+	st->wmsec[2] = (tmout >> 16) & 0xff;
+	st->bState = emu->state;
+	st->istr = 0;
+	return sizeof(*st);
+}
+
+static int emu_request(struct f_dfuemu *emu, const struct usb_ctrlrequest *ctrl,
+			struct usb_request *req)
+{
+	u16 w_length = le16_to_cpu(ctrl->wLength);
+	int in = ctrl->bRequestType & USB_DIR_IN;
+	struct {
+		__le16 usMarker;
+		__le16 usVersion;
+	} *marker;
+
+	if (emu->stall_every && ++emu->nreq % emu->stall_every == 0)
+		return -EOPNOTSUPP;
+	switch (ctrl->bRequest) {
+	case USB_DFU_DNLOAD:
+		if (in || !(emu->attributes & 0x01))
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		if (emu->state != dfuIDLE && emu->state != dfuDNLOAD_IDLE)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		if (w_length == 0) {
+			if (emu->state == dfuIDLE)
+				return emu_error(emu, DFU_ERR_NOTDONE);
+			emu->state = dfuMANIFEST_SYNC;
+			return 0;
+		}
+		if (w_length > emu->xfersize)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		req->complete = emu_dnload_complete;
+		req->context = emu;
+		return w_length;
+	case USB_DFU_UPLOAD:
+		if (!in || !(emu->attributes & 0x02))
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		if (emu->state != dfuIDLE && emu->state != dfuUPLOAD_IDLE)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		if (w_length > emu->xfersize)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		return emu_upload(emu, req->buf, w_length);
+	case USB_DFU_GETSTATUS:
+		if (!in)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		return min_t(int, w_length, emu_getstatus(emu, req->buf));
+	case USB_DFU_CLRSTATUS:
+		if (emu->state != dfuERROR)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		emu_reset(emu);
+		return 0;
+	case USB_DFU_GETSTATE:
+		if (!in || w_length < 1)
+			return emu_error(emu, DFU_ERR_STALLEDPKT);
+		*(u8 *)req->buf = emu->state;
+		return 1;
+	case USB_DFU_ABORT:
+		switch (emu->state) {
+		case dfuIDLE:
+		case dfuDNLOAD_SYNC:
+		case dfuDNLOAD_IDLE:
+		case dfuMANIFEST_SYNC:
+		case dfuUPLOAD_IDLE:
+			emu_reset(emu);
+			return 0;
+		}
+		return emu_error(emu, DFU_ERR_STALLEDPKT);
+	case USB_DFU_DETACH:
+		return 0;
+	case TIVA_REQUEST:
+		if (!in || !emu->tiva || w_length < sizeof(*marker))
+			return -EOPNOTSUPP;
+		marker = req->buf;
+		marker->usMarker = cpu_to_le16(0x4c4d);
+		marker->usVersion = cpu_to_le16(0x0001);
+		return sizeof(*marker);
+	}
+	return emu_error(emu, DFU_ERR_STALLEDPKT);
+}
+
+static int dfuemu_setup(struct usb_function *f,
+			const struct usb_ctrlrequest *ctrl)
+{
+	struct f_dfuemu *emu = func_to_emu(f);
+	struct usb_composite_dev *cdev = f->config->cdev;
+	struct usb_request *req = cdev->req;
+	unsigned long flags;
+	int value;
+
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS ||
+	    (le16_to_cpu(ctrl->wIndex) & 0xff) != emu->intf)
+		return -EOPNOTSUPP;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	value = emu_request(emu, ctrl, req);
+	spin_unlock_irqrestore(&emu->lock, flags);
+	if (value < 0)
+		return value;
+
+	req->length = value;
+	req->zero = value < le16_to_cpu(ctrl->wLength);
+	value = usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+	if (value < 0)
+		ERROR(cdev, "dfuemu response on err %d\n", value);
+	return value;
+}
+
+static int dfuemu_set_alt(struct usb_function *f, unsigned int intf,
+			unsigned int alt)
+{
+	struct f_dfuemu *emu = func_to_emu(f);
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	emu_reset(emu);
+	spin_unlock_irqrestore(&emu->lock, flags);
+	return 0;
+}
+
+/* a bus reset restarts the boot loader, even from dfuMANIFEST_WAIT_RESET */
+static void dfuemu_disable(struct usb_function *f)
+{
+	struct f_dfuemu *emu = func_to_emu(f);
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	emu_reset(emu);
+	emu->bin = 0;
+	spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+static int dfuemu_bind(struct usb_configuration *c, struct usb_function *f)
+{
+	struct f_dfuemu *emu = func_to_emu(f);
+	int id;
+
+	id = usb_interface_id(c, f);
+	if (id < 0)
+		return id;
+	emu->intf = id;
+	emu->intf_desc.bInterfaceNumber = id;
+
+	return usb_assign_descriptors(f, emu->descs, emu->descs, emu->descs,
+					NULL);
+}
+
+static void dfuemu_unbind(struct usb_configuration *c, struct usb_function *f)
+{
+	usb_free_all_descriptors(f);
+}
+
+static void dfuemu_free_func(struct usb_function *f)
+{
+	struct f_dfuemu *emu = func_to_emu(f);
+	struct f_dfuemu_opts *opts;
+
+	opts = container_of(f->fi, struct f_dfuemu_opts, func_inst);
+	mutex_lock(&opts->lock);
+	opts->refcnt--;
+	mutex_unlock(&opts->lock);
+	vfree(emu->flash);
+	kfree(emu);
+}
+
+static struct usb_function *dfuemu_alloc(struct usb_function_instance *fi)
+{
+	struct f_dfuemu_opts *opts;
+	struct f_dfuemu *emu;
+
+	opts = container_of(fi, struct f_dfuemu_opts, func_inst);
+	emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_lock(&opts->lock);
+	emu->xfersize = opts->xfersize;
+	emu->attributes = opts->attributes;
+	emu->poll_ms = opts->poll_ms;
+	emu->manifest_ms = opts->manifest_ms;
+	emu->flash_size = opts->flash_kb * 1024;
+	emu->fail_every = opts->fail_every;
+	emu->fail_status = opts->fail_status;
+	emu->stall_every = opts->stall_every;
+	emu->tiva = opts->tiva;
+	opts->refcnt++;
+	mutex_unlock(&opts->lock);
+
+	emu->flash = vmalloc(emu->flash_size);
+	if (!emu->flash) {
+		mutex_lock(&opts->lock);
+		opts->refcnt--;
+		mutex_unlock(&opts->lock);
+		kfree(emu);
+		return ERR_PTR(-ENOMEM);
+	}
+	memset(emu->flash, 0xff, emu->flash_size);
+	spin_lock_init(&emu->lock);
+	emu_reset(emu);
+
+	emu->intf_desc.bLength = USB_DT_INTERFACE_SIZE;
+	emu->intf_desc.bDescriptorType = USB_DT_INTERFACE;
+	emu->intf_desc.bNumEndpoints = 0;
+	emu->intf_desc.bInterfaceClass = USB_CLASS_APP_SPEC;
+	emu->intf_desc.bInterfaceSubClass = USB_DFU_SUBCLASS;
+	emu->intf_desc.bInterfaceProtocol = USB_DFU_PROTO_DFUMODE;
+	emu->fdsc.len = USB_DFU_FUNC_DSCLEN;
+	emu->fdsc.dsctyp = USB_DFU_FUNC_DSCTYP;
+	emu->fdsc.attr = emu->attributes;
+	emu->fdsc.tmout = cpu_to_le16(0xffff);
+	emu->fdsc.xfersize = cpu_to_le16(emu->xfersize);
+	emu->fdsc.ver = cpu_to_le16(0x0110);
+	emu->descs[0] = (struct usb_descriptor_header *)&emu->intf_desc;
+	emu->descs[1] = (struct usb_descriptor_header *)&emu->fdsc;
+	emu->descs[2] = NULL;
+
+	emu->function.name = "dfuemu";
+	emu->function.bind = dfuemu_bind;
+	emu->function.unbind = dfuemu_unbind;
+	emu->function.set_alt = dfuemu_set_alt;
+	emu->function.disable = dfuemu_disable;
+	emu->function.setup = dfuemu_setup;
+	emu->function.free_func = dfuemu_free_func;
+	return &emu->function;
+}
+
+static inline struct f_dfuemu_opts *to_f_dfuemu_opts(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct f_dfuemu_opts,
+			func_inst.group);
+}
+
+static void dfuemu_attr_release(struct config_item *item)
+{
+	struct f_dfuemu_opts *opts = to_f_dfuemu_opts(item);
+
+	usb_put_function_instance(&opts->func_inst);
+}
+
+static struct configfs_item_operations dfuemu_item_ops = {
+	.release	= dfuemu_attr_release,
+};
+
+/* a parameter of the emulated device, fixed once the function is linked */
+#define DFUEMU_ATTR(_name, _min, _max)					\
+static ssize_t f_dfuemu_opts_##_name##_show(struct config_item *item,	\
+					char *page)			\
+{									\
+	struct f_dfuemu_opts *opts = to_f_dfuemu_opts(item);		\
+	int result;							\
+									\
+	mutex_lock(&opts->lock);					\
+	result = sprintf(page, "%u\n", opts->_name);			\
+	mutex_unlock(&opts->lock);					\
+	return result;							\
+}									\
+									\
+static ssize_t f_dfuemu_opts_##_name##_store(struct config_item *item,	\
+					const char *page, size_t len)	\
+{									\
+	struct f_dfuemu_opts *opts = to_f_dfuemu_opts(item);		\
+	u32 num;							\
+	int ret;							\
+									\
+	mutex_lock(&opts->lock);					\
+	if (opts->refcnt) {						\
+		ret = -EBUSY;						\
+		goto end;						\
+	}								\
+	ret = kstrtou32(page, 0, &num);					\
+	if (ret)							\
+		goto end;						\
+	if (num < (_min) || num > (_max)) {				\
+		ret = -EINVAL;						\
+		goto end;						\
+	}								\
+	opts->_name = num;						\
+	ret = len;							\
+end:									\
+	mutex_unlock(&opts->lock);					\
+	return ret;							\
+}									\
+									\
+CONFIGFS_ATTR(f_dfuemu_opts_, _name)
+
+DFUEMU_ATTR(xfersize, 1, USB_COMP_EP0_BUFSIZ);
+DFUEMU_ATTR(attributes, 0, 0x0f);
+DFUEMU_ATTR(poll_ms, 0, 0xffffff);
+DFUEMU_ATTR(manifest_ms, 0, 0xffffff);
+DFUEMU_ATTR(flash_kb, 1, 0xffff);
+DFUEMU_ATTR(fail_every, 0, UINT_MAX);
+DFUEMU_ATTR(fail_status, 1, DFU_ERR_STALLEDPKT);
+DFUEMU_ATTR(stall_every, 0, UINT_MAX);
+DFUEMU_ATTR(tiva, 0, 1);
+
+static struct configfs_attribute *dfuemu_attrs[] = {
+	&f_dfuemu_opts_attr_xfersize,
+	&f_dfuemu_opts_attr_attributes,
+	&f_dfuemu_opts_attr_poll_ms,
+	&f_dfuemu_opts_attr_manifest_ms,
+	&f_dfuemu_opts_attr_flash_kb,
+	&f_dfuemu_opts_attr_fail_every,
+	&f_dfuemu_opts_attr_fail_status,
+	&f_dfuemu_opts_attr_stall_every,
+	&f_dfuemu_opts_attr_tiva,
+	NULL,
+};
+
+static struct config_item_type dfuemu_func_type = {
+	.ct_item_ops	= &dfuemu_item_ops,
+	.ct_attrs	= dfuemu_attrs,
+	.ct_owner	= THIS_MODULE,
+};
+
+static void dfuemu_free_inst(struct usb_function_instance *fi)
+{
+	kfree(container_of(fi, struct f_dfuemu_opts, func_inst));
+}
+
+static struct usb_function_instance *dfuemu_alloc_inst(void)
+{
+	struct f_dfuemu_opts *opts;
+
+	opts = kzalloc(sizeof(*opts), GFP_KERNEL);
+	if (!opts)
+		return ERR_PTR(-ENOMEM);
+	mutex_init(&opts->lock);
+	opts->func_inst.free_func_inst = dfuemu_free_inst;
+	opts->xfersize = TIVA_BLKSIZE;
+	opts->attributes = 0x07;
+	opts->poll_ms = 5;
+	opts->manifest_ms = 0;
+	opts->flash_kb = 256;
+	opts->fail_every = 0;
+	opts->fail_status = DFU_ERR_WRITE;
+	opts->stall_every = 0;
+	opts->tiva = 1;
+
+	config_group_init_type_name(&opts->func_inst.group, "",
+					&dfuemu_func_type);
+	return &opts->func_inst;
+}
+
+DECLARE_USB_FUNCTION_INIT(dfuemu, dfuemu_alloc_inst, dfuemu_alloc);
@@ -6,22 +6,159 @@
  * USB Abstract Control Model driver for USB Device Firmware Upgrade
  *
  */
+#include <linux/string.h>
 #include "usbdfu.h"
+#include "usbdfu_trace.h"
 
 static void dfu_ctrlurb_done(struct urb *urb)
 {
 	struct dfu_control *ctrl;
 
 	ctrl = urb->context;
+	ctrl->tdone = ktime_get();
 	ctrl->status = urb->status;
 	ctrl->nxfer = urb->actual_length;
 	complete(&ctrl->urbdone);
 }
 
+#define DFU_RTT_MINSAMPLES	16	/* before the timeout adapts */
+#define DFU_RTO_MIN_MS		50
+#define DFU_RTO_MAXBACKOFF	4
+
+static inline struct dfu_reqstats *dfu_reqslot(struct dfu_control *ctrl)
+{
+	if (ctrl->req.bRequest <= USB_DFU_ABORT)
+		return &ctrl->stats->req[ctrl->req.bRequest];
+	return &ctrl->stats->req[DFU_NREQS - 1];
+}
+
+/* smoothed round trip time and its variation, as TCP does, RFC 6298 */
+static void dfu_rtt_sample(struct dfu_reqstats *rst, unsigned int usec)
+{
+	int delta;
+
+	if (rst->rtt_samples++ == 0) {
+		rst->srtt_us = usec;
+		rst->rttvar_us = usec / 2;
+		return;
+	}
+	delta = (int)usec - (int)rst->srtt_us;
+	rst->rttvar_us += ((delta < 0 ? -delta : delta) -
+				(int)rst->rttvar_us) / 4;
+	rst->srtt_us += delta / 8;
+}
+
+/*
+ * The timeout of a request is its srtt + 4 * rttvar, doubled for each
+ * timeout in a row, once enough round trips have been measured. It is
+ * never more than @tmout, the urb_timeout module parameter, and never
+ * less than DFU_RTO_MIN_MS.
+ */
+static int dfu_adapt_tmout(struct dfu_control *ctrl, int tmout)
+{
+	struct dfu_reqstats *rst;
+	unsigned long flags;
+	unsigned int rto;
+
+	if (!ctrl->stats)
+		return tmout;
+	spin_lock_irqsave(&ctrl->stats->lock, flags);
+	rst = dfu_reqslot(ctrl);
+	if (rst->rtt_samples < DFU_RTT_MINSAMPLES) {
+		spin_unlock_irqrestore(&ctrl->stats->lock, flags);
+		return tmout;
+	}
+	rto = DIV_ROUND_UP(rst->srtt_us + max(4 * rst->rttvar_us, 1000U),
+				USEC_PER_MSEC);
+	rto <<= rst->backoff;
+	spin_unlock_irqrestore(&ctrl->stats->lock, flags);
+	if (rto < DFU_RTO_MIN_MS)
+		rto = DFU_RTO_MIN_MS;
+	return rto < tmout ? rto : tmout;
+}
+
+static void dfu_stats_urb(struct dfu_control *ctrl, int timedout)
+{
+	struct dfu_reqstats *rst;
+	unsigned long flags;
+	unsigned int usec;
+	int bkt;
+
+	usec = ktime_us_delta(ctrl->tdone, ctrl->tstart);
+	bkt = fls(usec);
+	if (bkt >= DFU_HIST_BUCKETS)
+		bkt = DFU_HIST_BUCKETS - 1;
+	spin_lock_irqsave(&ctrl->stats->lock, flags);
+	rst = dfu_reqslot(ctrl);
+	if (timedout) {
+		if (rst->backoff < DFU_RTO_MAXBACKOFF)
+			rst->backoff++;
+	} else if (ctrl->status == 0) {
+		rst->backoff = 0;
+		dfu_rtt_sample(rst, usec);
+	}
+	rst->count++;
+	if (ctrl->status)
+		rst->errors++;
+	rst->total_us += usec;
+	if (usec > rst->max_us)
+		rst->max_us = usec;
+	rst->hist[bkt]++;
+	spin_unlock_irqrestore(&ctrl->stats->lock, flags);
+}
+
+/*
+ * Cache the state and status reported by a GETSTATUS or GETSTATE, trace
+ * state transitions and tell the owner of the stats about any change.
+ * Without stats there is no last state to compare with, so every report
+ * is traced.
+ */
+static void dfu_note_state(struct dfu_control *ctrl)
+{
+	struct dfu_stats *st;
+	unsigned long flags;
+	int from, to, bstatus, changed;
+
+	if (ctrl->req.bRequest == USB_DFU_GETSTATUS &&
+			ctrl->nxfer >= sizeof(struct dfu_status)) {
+		to = ctrl->dfuStatus.bState;
+		bstatus = ctrl->dfuStatus.bStatus;
+	} else if (ctrl->req.bRequest == USB_DFU_GETSTATE &&
+			ctrl->nxfer >= 1) {
+		to = ctrl->dfuState;
+		bstatus = -1;
+	} else
+		return;
+
+	st = ctrl->stats;
+	if (!st) {
+		trace_dfu_state(ctrl, -1, to, bstatus);
+		return;
+	}
+	spin_lock_irqsave(&st->lock, flags);
+	from = st->state;
+	changed = from != to || (bstatus >= 0 && bstatus != st->status);
+	st->state = to;
+	if (bstatus >= 0)
+		st->status = bstatus;
+	spin_unlock_irqrestore(&st->lock, flags);
+	if (from != to)
+		trace_dfu_state(ctrl, from, to, bstatus);
+	if (changed && st->notify)
+		st->notify(st);
+}
+
 static void dfu_urb_timeout(struct dfu_control *ctrl)
 {
+	unsigned long flags;
+
 	usb_unlink_urb(ctrl->dfurb);
 	wait_for_completion(&ctrl->urbdone);
+	if (ctrl->stats) {
+		spin_lock_irqsave(&ctrl->stats->lock, flags);
+		ctrl->stats->timeouts++;
+		spin_unlock_irqrestore(&ctrl->stats->lock, flags);
+	}
 	if (ctrl->req.bRequest != USB_DFU_ABORT)
 		dev_err(&ctrl->intf->dev,
 			"URB req type: %2.2x, req: %2.2x cancelled\n",
@@ -29,28 +166,51 @@ static void dfu_urb_timeout(struct dfu_control *ctrl)
 			(int)ctrl->req.bRequest);
 }
 
-int dfu_submit_urb(struct dfu_control *ctrl, int tmout)
+int dfu_start_urb(struct dfu_control *ctrl)
 {
-	int retusb, retv;
-	unsigned long jiff_wait;
+	int retusb;
 
+	if (ctrl->pipelock)
+		mutex_lock(ctrl->pipelock);
 	usb_fill_control_urb(ctrl->dfurb, ctrl->usbdev, ctrl->pipe,
 			(__u8 *)&ctrl->req, ctrl->datbuf, ctrl->len,
 			dfu_ctrlurb_done, ctrl);
 	init_completion(&ctrl->urbdone);
 	ctrl->status = USB_DFU_ERROR_CODE;
 	ctrl->nxfer = 0;
+	ctrl->tstart = ktime_get();
+	trace_dfu_urb_submit(ctrl);
 	retusb = usb_submit_urb(ctrl->dfurb, GFP_KERNEL);
-	if (retusb == 0) {
-		jiff_wait = msecs_to_jiffies(tmout);
-		if (!wait_for_completion_timeout(&ctrl->urbdone, jiff_wait))
-			dfu_urb_timeout(ctrl);
-	} else
+	if (retusb != 0) {
 		dev_err(&ctrl->intf->dev,
 			"URB type: %2.2x, req: %2.2x submit failed: %d\n",
 			(int)ctrl->req.bRequestType,
 			(int)ctrl->req.bRequest, retusb);
+		if (ctrl->pipelock)
+			mutex_unlock(ctrl->pipelock);
+	}
+	return retusb;
+}
+
+int dfu_wait_urb(struct dfu_control *ctrl, int tmout)
+{
+	int retv, timedout;
+	unsigned long jiff_wait;
+
+	jiff_wait = msecs_to_jiffies(dfu_adapt_tmout(ctrl, tmout));
+	timedout = 0;
+	if (!wait_for_completion_timeout(&ctrl->urbdone, jiff_wait)) {
+		dfu_urb_timeout(ctrl);
+		timedout = 1;
+	}
+	if (ctrl->stats)
+		dfu_stats_urb(ctrl, timedout);
+	trace_dfu_urb_done(ctrl, ktime_us_delta(ctrl->tdone, ctrl->tstart));
 	retv = READ_ONCE(ctrl->status);
+	if (ctrl->pipelock)
+		mutex_unlock(ctrl->pipelock);
+	if (retv == 0 && ctrl->req.bRequestType == 0xa1)
+		dfu_note_state(ctrl);
 	if (retv && ctrl->req.bRequest != USB_DFU_ABORT)
 		dev_err(&ctrl->intf->dev,
 			"URB type: %2.2x, req: %2.2x request failed: %d\n",
@@ -59,3 +219,59 @@ int dfu_submit_urb(struct dfu_control *ctrl, int tmout)
 
 	return retv;
 }
+
+int dfu_submit_urb(struct dfu_control *ctrl, int tmout)
+{
+	int retv;
+
+	if (dfu_start_urb(ctrl) == 0)
+		return dfu_wait_urb(ctrl, tmout);
+
+	retv = READ_ONCE(ctrl->status);
+	if (retv && ctrl->req.bRequest != USB_DFU_ABORT)
+		dev_err(&ctrl->intf->dev,
+			"URB type: %2.2x, req: %2.2x request failed: %d\n",
+			(int)ctrl->req.bRequestType, (int)ctrl->req.bRequest,
+			retv);
+	return retv;
+}
+
+static const struct dfu_quirk dfu_quirks[] = {
+	{ 0x1cbe, 0x00ff, 0x0000, 0xffff, DFU_QUIRK_TIVA },
+	{ 0x0483, 0xdf11, 0x0000, 0xffff, DFU_QUIRK_DFUSE },
+	{ }
+};
+
+int dfu_get_quirk(struct usb_device *udev, const char *param,
+			struct dfu_quirk *q)
+{
+	const struct dfu_quirk *qt;
+	u16 vid, pid, bcd;
+	int n;
+
+	vid = le16_to_cpu(udev->descriptor.idVendor);
+	pid = le16_to_cpu(udev->descriptor.idProduct);
+	bcd = le16_to_cpu(udev->descriptor.bcdDevice);
+	memset(q, 0, sizeof(*q));
+	while (param && *param) {
+		n = sscanf(param, "%hx:%hx:%x:%u:%u:%u", &q->idVendor,
+				&q->idProduct, &q->flags, &q->poll_ms,
+				&q->release_ms, &q->maxxfer);
+		if (n >= 3 && q->idVendor == vid && q->idProduct == pid) {
+			q->bcd_hi = 0xffff;
+			return 1;
+		}
+		memset(q, 0, sizeof(*q));
+		param = strchr(param, ',');
+		if (param)
+			param++;
+	}
+	for (qt = dfu_quirks; qt->idVendor; qt++) {
+		if (qt->idVendor == vid && qt->idProduct == pid &&
+				bcd >= qt->bcd_lo && bcd <= qt->bcd_hi) {
+			*q = *qt;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -9,6 +9,9 @@
  *
 */
 #include <linux/usb.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
 
 #define USB_DFU_DETACH		0
 #define USB_DFU_DNLOAD		1
@@ -64,6 +67,34 @@ enum dfu_state {
 	dfuERROR = 10
 };
 
+#define DFU_NREQS		8	/* class requests, plus one for vendor ones */
+#define DFU_HIST_BUCKETS	20	/* bucket n: [2^(n-1), 2^n) microseconds */
+
+struct dfu_reqstats {
+	__u64 count;
+	__u64 errors;
+	__u64 total_us;
+	__u32 max_us;
+	__u32 hist[DFU_HIST_BUCKETS];
+	__u32 rtt_samples;
+	__u32 srtt_us, rttvar_us;	/* for the adaptive timeout */
+	__u32 backoff;			/* timeouts in a row */
+};
+
+struct dfu_stats {
+	spinlock_t lock;
+	int state;		/* last DFU state seen, -1 if none */
+	int status;		/* last bStatus seen, -1 if none */
+	void (*notify)(struct dfu_stats *stats);  /* state or status changed */
+	struct dfu_reqstats req[DFU_NREQS];
+	__u64 timeouts;
+	__u64 retries;		/* blocks resent after transient errors */
+	__u64 dnload_bytes, dnload_blocks;
+	__u64 upload_bytes, upload_blocks;
+	__u64 busy_total_us, busy_polls;
+	__u32 busy_max_us;
+};
+
 struct dfu_control {
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
@@ -76,6 +107,9 @@ struct dfu_control {
 	int nxfer;
 	struct urb *dfurb;
 	void *datbuf;
+	struct dfu_stats *stats;	/* NULL if not accounted */
+	struct mutex *pipelock;		/* held from start to wait, or NULL */
+	ktime_t tstart, tdone;
 	union {
 		unsigned long ocupy[8];
 		struct dfu_status dfuStatus;
@@ -84,6 +118,40 @@ struct dfu_control {
 	};
 };
 
+#define DFU_QUIRK_FASTUP	0x01	/* no GETSTATUS after full UPLOAD blocks */
+#define DFU_QUIRK_BIGXFER	0x02	/* takes blocks of up to maxxfer */
+#define DFU_QUIRK_RESET		0x04	/* needs a bus reset after DETACH */
+#define DFU_QUIRK_TIVA		0x08	/* Tiva/Stellaris vendor commands */
+#define DFU_QUIRK_DFUSE		0x10	/* ST DfuSe, also from bcdDFU 0x011a */
+
+struct dfu_quirk {
+	__u16 idVendor, idProduct;
+	__u16 bcd_lo, bcd_hi;	/* bcdDevice range */
+	unsigned int flags;	/* DFU_QUIRK_* */
+	unsigned int poll_ms;	/* replaces bwPollTimeout if not 0 */
+	unsigned int release_ms;	/* settle time at the end of a session */
+	unsigned int maxxfer;	/* with DFU_QUIRK_BIGXFER */
+};
+
+/*
+ * Find the quirks of @udev, first in @param, then in the built-in table.
+ * @param is a module parameter of comma separated entries
+ * "vid:pid:flags[:poll_ms[:release_ms[:maxxfer]]]", in hex up to flags.
+ * Returns 0 and zeroes @q if the device has no quirks.
+ */
+int dfu_get_quirk(struct usb_device *udev, const char *param,
+			struct dfu_quirk *q);
+
 int dfu_submit_urb(struct dfu_control *ctrl, int tmout);
+/*
+ * Split halves of dfu_submit_urb(), so that a caller can do useful work
+ * while the control transfer is on the wire. Every successful
+ * dfu_start_urb() must be paired with exactly one dfu_wait_urb().
+ */
+int dfu_start_urb(struct dfu_control *ctrl);
+int dfu_wait_urb(struct dfu_control *ctrl, int tmout);
+
+/* exported by dfusb1, for dfusb0 to wait for the device it switched */
+int dfu1_wait_device(const char *portpath, ktime_t start, int tmout);
 
 #endif /* LINUX_USB_DFU_DSCAO__ */
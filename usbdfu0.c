@@ -12,8 +12,13 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/uaccess.h>
+#include <linux/kmod.h>
 #include "usbdfu0.h"
 
+#define CREATE_TRACE_POINTS
+#define DFU_TRACE_SYSTEM dfusb0
+#include "usbdfu_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Dashi Cao");
 MODULE_DESCRIPTION("USB DFU Class Driver for Protocol 0");
@@ -28,6 +33,16 @@ module_param(detach_timeout, int, 0644);
 MODULE_PARM_DESC(detach_timeout, "Time window for reset after detaching DFU. "
 	"Default 2 seconds.");
 
+static int switch_timeout = 10000; /* 10 seconds */
+module_param(switch_timeout, int, 0644);
+MODULE_PARM_DESC(switch_timeout, "Time allowed for the DFU mode device to "
+	"show up after a switch. Default 10 seconds.");
+
+static char *quirks;
+module_param(quirks, charp, 0444);
+MODULE_PARM_DESC(quirks, "Device quirks, vid:pid:flags,... flags 4: reset "
+	"the device after DETACH even if it can detach. Default: none");
+
 static const struct usb_device_id dfu_ids[] = {
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, USB_DFU_SUBCLASS,
 		USB_DFU_PROTO_RUNTIME) },
@@ -61,13 +76,15 @@ static ssize_t dfu_switch(struct device *dev, struct device_attribute *attr,
 	struct dfu0_device *dfudev;
 	struct dfu_control *ctrl;
 
-	dfudev = container_of(attr, struct dfu0_device, tachattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
 	if (!ctrl)
 		return -ENOMEM;
 	ctrl->usbdev = dfudev->usbdev;
 	ctrl->intf = dfudev->intf;
 	ctrl->intfnum = dfudev->intfnum;
+	ctrl->stats = NULL;
+	ctrl->pipelock = NULL;
 	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
 	if (!ctrl->dfurb) {
 		kfree(ctrl);
@@ -84,12 +101,87 @@ static ssize_t dfu_switch(struct device *dev, struct device_attribute *attr,
 	return count;
 }
 
+/*
+ * Detach, reset the device within the detach window unless it detaches
+ * by itself, and wait for dfusb1 to take the DFU mode device on the same
+ * port. The reset, or the device detaching by itself, unbinds this
+ * interface and removes this very file while the write is still waiting,
+ * so nothing of dfudev is touched once the active protection is broken.
+ */
+static ssize_t dfu_fast_switch(struct device *dev,
+			struct device_attribute *attr, const char *buf,
+			size_t count)
+{
+	struct dfu0_device *dfudev;
+	struct dfu_control *ctrl;
+	int (*wait_dfu)(const char *, ktime_t, int);
+	char portpath[32];
+	struct kernfs_node *kn;
+	ktime_t start;
+	int retv;
+
+	if (count < 1 || *buf != '-' || (*(buf+1) != '\n' && *(buf+1) != 0)) {
+		dev_err(dev, "Invalid Command: %c\n", *buf);
+		return count;
+	}
+	wait_dfu = symbol_get(dfu1_wait_device);
+	if (!wait_dfu) {
+		request_module("dfusb1");
+		wait_dfu = symbol_get(dfu1_wait_device);
+		if (!wait_dfu)
+			return -ENOENT;
+	}
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	strlcpy(portpath, dev_name(&dfudev->usbdev->dev), sizeof(portpath));
+	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
+	if (!ctrl) {
+		retv = -ENOMEM;
+		goto err_10;
+	}
+	ctrl->usbdev = dfudev->usbdev;
+	ctrl->intf = dfudev->intf;
+	ctrl->intfnum = dfudev->intfnum;
+	ctrl->stats = NULL;
+	ctrl->pipelock = NULL;
+	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!ctrl->dfurb) {
+		retv = -ENOMEM;
+		goto err_20;
+	}
+	start = ktime_get();
+	retv = dfu_do_switch(dfudev, ctrl);
+	usb_free_urb(ctrl->dfurb);
+	kfree(ctrl);
+	if (retv)
+		goto err_10;
+
+	if (!dfudev->detach)
+		usb_queue_reset_device(dfudev->intf);
+	kn = sysfs_break_active_protection(&dev->kobj, &attr->attr);
+	retv = wait_dfu(portpath, start, switch_timeout);
+	if (kn)
+		sysfs_unbreak_active_protection(kn);
+	symbol_put(dfu1_wait_device);
+	if (retv < 0) {
+		pr_err("%s: switch to DFU mode failed: %d\n", portpath, retv);
+		return retv;
+	}
+	return count;
+
+err_20:
+	kfree(ctrl);
+err_10:
+	symbol_put(dfu1_wait_device);
+	return retv;
+}
+
 static ssize_t dfu_attr_show(struct device *dev, struct device_attribute *attr,
 				char *buf)
 {
 	struct dfu0_device *dfudev;
 
-	dfudev = container_of(attr, struct dfu0_device, attrattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	return sprintf(buf, "Download:%d Upload:%d Manifest:%d Detach:%d\n",
 		dfudev->download, dfudev->upload, dfudev->manifest,
 		dfudev->detach);
@@ -100,7 +192,7 @@ static ssize_t dfu_timeout_show(struct device *dev,
 {
 	struct dfu0_device *dfudev;
 
-	dfudev = container_of(attr, struct dfu0_device, tmoutattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	return sprintf(buf, "%d\n", dfudev->dettmout);
 }
 
@@ -109,73 +201,33 @@ static ssize_t dfu_xfersize_show(struct device *dev,
 {
 	struct dfu0_device *dfudev;
 
-	dfudev = container_of(attr, struct dfu0_device, xsizeattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	return sprintf(buf, "%d\n", dfudev->xfersize);
 }
 
-static int dfu_create_attrs(struct dfu0_device *dfudev)
-{
-	int retv = 0;
-
-	dfudev->tachattr.attr.name = "detach";
-	dfudev->tachattr.attr.mode = 0200;
-	dfudev->tachattr.show = NULL;
-	dfudev->tachattr.store = dfu_switch;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->tachattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		return retv;
-	}
-	dfudev->attrattr.attr.name = "attr";
-	dfudev->attrattr.attr.mode = 0444;
-	dfudev->attrattr.show = dfu_attr_show;
-	dfudev->attrattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->attrattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_10;
-	}
-	dfudev->tmoutattr.attr.name = "timeout";
-	dfudev->tmoutattr.attr.mode = 0444;
-	dfudev->tmoutattr.show = dfu_timeout_show;
-	dfudev->tmoutattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->tmoutattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_20;
-	}
-	dfudev->xsizeattr.attr.name = "xfersize";
-	dfudev->xsizeattr.attr.mode = 0444;
-	dfudev->xsizeattr.show = dfu_xfersize_show;
-	dfudev->xsizeattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->xsizeattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_30;
-	}
-
-	return retv;
+static struct device_attribute dfu_attr_detach =
+	__ATTR(detach, 0200, NULL, dfu_switch);
+static struct device_attribute dfu_attr_attr =
+	__ATTR(attr, 0444, dfu_attr_show, NULL);
+static struct device_attribute dfu_attr_timeout =
+	__ATTR(timeout, 0444, dfu_timeout_show, NULL);
+static struct device_attribute dfu_attr_xfersize =
+	__ATTR(xfersize, 0444, dfu_xfersize_show, NULL);
+static struct device_attribute dfu_attr_switch =
+	__ATTR(switch, 0200, NULL, dfu_fast_switch);
 
-err_30:
-	device_remove_file(&dfudev->intf->dev, &dfudev->tmoutattr);
-err_20:
-	device_remove_file(&dfudev->intf->dev, &dfudev->attrattr);
-err_10:
-	device_remove_file(&dfudev->intf->dev, &dfudev->tachattr);
-	return retv;
-}
+static struct attribute *dfu_attrs[] = {
+	&dfu_attr_detach.attr,
+	&dfu_attr_attr.attr,
+	&dfu_attr_timeout.attr,
+	&dfu_attr_xfersize.attr,
+	&dfu_attr_switch.attr,
+	NULL
+};
 
-static void dfu_remove_attrs(struct dfu0_device *dfudev)
-{
-	device_remove_file(&dfudev->intf->dev, &dfudev->xsizeattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->tmoutattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->attrattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->tachattr);
-}
+static const struct attribute_group dfu_attr_group = {
+	.attrs = dfu_attrs,
+};
 
 static int dfu_probe(struct usb_interface *intf,
 			const struct usb_device_id *id)
@@ -184,6 +236,7 @@ static int dfu_probe(struct usb_interface *intf,
 	struct dfu0_device *dfudev;
 	struct dfufdsc *dfufdsc;
 	int dfufdsc_len;
+	struct dfu_quirk quirk;
 
 	dfufdsc = (struct dfufdsc *)intf->cur_altsetting->extra;
 	dfufdsc_len = intf->cur_altsetting->extralen;
@@ -206,12 +259,19 @@ static int dfu_probe(struct usb_interface *intf,
 	dfudev->usbdev = interface_to_usbdev(intf);
 	dfudev->intfnum = intf->cur_altsetting->desc.bInterfaceNumber;
 	dfudev->proto = 1;
+	if (dfu_get_quirk(dfudev->usbdev, quirks, &quirk) &&
+			(quirk.flags & DFU_QUIRK_RESET)) {
+		dev_info(&intf->dev, "Quirks: %x\n", quirk.flags);
+		dfudev->detach = 0;
+	}
 
-	retv = dfu_create_attrs(dfudev);
-	if (retv)
+	usb_set_intfdata(intf, dfudev);
+	retv = sysfs_create_group(&intf->dev.kobj, &dfu_attr_group);
+	if (retv) {
+		dev_err(&intf->dev, "Cannot create sysfs files %d\n", retv);
+		usb_set_intfdata(intf, NULL);
 		kfree(dfudev);
-	else
-		usb_set_intfdata(intf, dfudev);
+	}
 	return retv;
 }
 
@@ -220,7 +280,7 @@ static void dfu_disconnect(struct usb_interface *intf)
 	struct dfu0_device *dfudev;
 
 	dfudev = usb_get_intfdata(intf);
-	dfu_remove_attrs(dfudev);
+	sysfs_remove_group(&intf->dev.kobj, &dfu_attr_group);
 	usb_set_intfdata(dfudev->intf, NULL);
 	kfree(dfudev);
 }
@@ -230,6 +290,7 @@ static struct usb_driver dfu_driver = {
 	.probe = dfu_probe,
 	.disconnect = dfu_disconnect,
 	.id_table = dfu_ids,
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 static int __init usbdfu_init(void)
@@ -13,10 +13,6 @@
 struct dfu0_device {
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
-	struct device_attribute tachattr;
-	struct device_attribute attrattr;
-	struct device_attribute tmoutattr;
-	struct device_attribute xsizeattr;
 	struct {
 		unsigned int download:1;
 		unsigned int upload:1;
@@ -13,11 +13,36 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/fs.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
 #include <linux/dma-mapping.h>
+#include <linux/vmalloc.h>
+#include <linux/file.h>
+#include <linux/firmware.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/eventfd.h>
+#include <linux/idr.h>
+#include <linux/hashtable.h>
+#include <linux/crc32.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
 #include <linux/uaccess.h>
+#include <asm/unaligned.h>
 #include "usbdfu1.h"
+#include "usbdfu_ioctl.h"
 
-#define BLKSIZE	1024
+#define CREATE_TRACE_POINTS
+#define DFU_TRACE_SYSTEM dfusb1
+#include "usbdfu_trace.h"
+
+#define DFU_MAX_IMAGE	(16 << 20)
+#define DFU_MANIFEST_TMOUT	10000	/* milliseconds */
+#define DFU_RETRY_MSEC		10	/* first backoff, doubled per retry */
+#define DFU_RETRY_MAXMSEC	500
 #define DFUDEV_NAME "dfu"
 
 MODULE_LICENSE("GPL");
@@ -25,27 +50,70 @@ MODULE_AUTHOR("Dashi Cao");
 MODULE_DESCRIPTION("Tiva C USB DFU Driver");
 
 #define USB_VENDOR_LUMINARY 0x1cbe
-#define USB_PRODUCT_STELLARIS_DFU 0x0ff
+#define USB_VENDOR_STM 0x0483
+#define USB_PRODUCT_STM_DFUSE 0xdf11
 
-static int max_dfus = 8;
-module_param(max_dfus, int, 0644);
+static int max_dfus = 256;
+module_param(max_dfus, int, 0444);
 MODULE_PARM_DESC(max_dfus, "Maximum number of USB DFU devices. "
-	"Default: 8");
+	"Default: 256");
 
 static int urb_timeout = 200; /* milliseconds */
 module_param(urb_timeout, int, 0644);
-MODULE_PARM_DESC(urb_timeout, "USB urb completion timeout. "
-	"Default: 200 milliseconds.");
+MODULE_PARM_DESC(urb_timeout, "Upper bound of the USB urb completion "
+	"timeout, which adapts to the measured round trip time of each "
+	"request. Default: 200 milliseconds.");
+
+static int poll_mode = 1;
+module_param(poll_mode, int, 0644);
+MODULE_PARM_DESC(poll_mode, "DNLOAD_BUSY poll method. 0: msleep, "
+	"1: high resolution, 2: adaptive to the observed busy time. "
+	"Default: 1");
+
+static int dnload_retries = 3;
+module_param(dnload_retries, int, 0644);
+MODULE_PARM_DESC(dnload_retries, "Times a block is resent after a transient "
+	"USB error. Default: 3");
+
+static int resume_timeout = 30000; /* milliseconds */
+module_param(resume_timeout, int, 0644);
+MODULE_PARM_DESC(resume_timeout, "How long an interrupted download is kept "
+	"for a reopened session to resume. Default 30 seconds.");
+
+static bool async_manifest;
+module_param(async_manifest, bool, 0644);
+MODULE_PARM_DESC(async_manifest, "Return from close() at once and let a "
+	"worker follow the device through manifestation. Default: off");
+
+static bool zerocopy;
+module_param(zerocopy, bool, 0644);
+MODULE_PARM_DESC(zerocopy, "Transfer straight from/to pinned user pages. "
+	"Default: off");
+
+static int upload_cache;
+module_param(upload_cache, int, 0644);
+MODULE_PARM_DESC(upload_cache, "KiB of memory for complete uploads, kept "
+	"by device serial until the device is downloaded to again. "
+	"Default: 0, no cache");
+
+static char *quirks;
+module_param(quirks, charp, 0444);
+MODULE_PARM_DESC(quirks, "Device quirks, vid:pid:flags[:poll_ms[:release_ms"
+	"[:maxxfer]]],... flags 1: fast upload, 2: maxxfer blocks, "
+	"8: Tiva commands. Default: none");
 
 static const struct usb_device_id dfu_ids[] = {
 	{ USB_DFU_INTERFACE_INFO(USB_VENDOR_LUMINARY,
 		USB_CLASS_APP_SPEC, USB_DFU_SUBCLASS, USB_DFU_PROTO_DFUMODE) },
+	{ USB_DEVICE_AND_INTERFACE_INFO(USB_VENDOR_STM, USB_PRODUCT_STM_DFUSE,
+		USB_CLASS_APP_SPEC, USB_DFU_SUBCLASS, USB_DFU_PROTO_DFUMODE) },
 	{ }
 };
 MODULE_DEVICE_TABLE(usb, dfu_ids);
 
 static dev_t dfu_devno;
 static struct class *dfu_class;
+static struct workqueue_struct *dfu_wq;
 
 static inline int dfu_abort(struct dfu_control *ctrl)
 {
@@ -117,281 +185,2999 @@ static inline int dfu_finish_dnload(struct dfu_control *ctrl)
 	return dfu_submit_urb(ctrl, urb_timeout);
 }
 
+#define DFU_ASYNC_BUFLEN	(64 << 10)	/* staging of nonblocking I/O */
+#define DFU_ZC_MAXPAGES	512
+
+/* user pages pinned for the duration of one read() or write() */
+struct dfu_upages {
+	struct page **pages;
+	unsigned long first;
+	int npages;
+	int write;
+};
+
 static inline unsigned int altrim(unsigned int v, int sf)
 {
 	return (((v -1) >> sf) + 1) << sf;
 }
 
-static int dfu_open(struct inode *inode, struct file *filp)
+static void dfu_count_xfer(struct dfu1_device *dfudev, int upload, int len)
+{
+	spin_lock_irq(&dfudev->stats.lock);
+	if (upload) {
+		dfudev->stats.upload_bytes += len;
+		dfudev->stats.upload_blocks++;
+	} else {
+		dfudev->stats.dnload_bytes += len;
+		dfudev->stats.dnload_blocks++;
+	}
+	spin_unlock_irq(&dfudev->stats.lock);
+}
+
+static int dfu_pin_user(struct dfu1_device *dfudev, struct dfu_upages *up,
+			unsigned long uaddr, size_t count, int write)
+{
+	int pinned;
+
+	if (!zerocopy || count < PAGE_SIZE ||
+			!dfudev->usbdev->bus->controller->dma_mask)
+		return -EINVAL;
+	up->first = uaddr & PAGE_MASK;
+	up->npages = DIV_ROUND_UP(offset_in_page(uaddr) + count, PAGE_SIZE);
+	if (up->npages > DFU_ZC_MAXPAGES)
+		return -E2BIG;
+	up->pages = kmalloc_array(up->npages, sizeof(struct page *),
+					GFP_KERNEL);
+	if (!up->pages)
+		return -ENOMEM;
+	up->write = write;
+	pinned = get_user_pages_fast(up->first, up->npages,
+					write ? FOLL_WRITE : 0, up->pages);
+	if (pinned == up->npages)
+		return 0;
+
+	while (--pinned >= 0)
+		put_page(up->pages[pinned]);
+	kfree(up->pages);
+	return -EFAULT;
+}
+
+static void dfu_unpin_user(struct dfu_upages *up)
+{
+	int i;
+
+	for (i = 0; i < up->npages; i++) {
+		if (up->write)
+			set_page_dirty_lock(up->pages[i]);
+		put_page(up->pages[i]);
+	}
+	kfree(up->pages);
+}
+
+/*
+ * Point a transfer slot straight at pinned user memory. Only blocks that
+ * sit inside one lowmem page qualify, the rest go through the bounce
+ * buffer. The mapping covers just this block, so bounced bytes that
+ * share a page never meet a stale cache line.
+ */
+static int dfu_zc_map(struct dfu1_device *dfudev, struct dfu_upages *up,
+			int slot, unsigned long uaddr, int len,
+			enum dma_data_direction dir)
 {
-	struct dfu1_device *dfudev;
-	int state, retv, buflen;
 	struct dfu_control *ctrl;
-	void *datbuf;
+	struct device *ctrler;
+	struct page *page;
+	unsigned int off;
+	dma_addr_t dmabuf;
+	void *vaddr;
 
-	retv = 0;
-	dfudev = container_of(inode->i_cdev, struct dfu1_device, cdev);
-	filp->private_data = dfudev;
-	if (mutex_lock_interruptible(&dfudev->lock))
-		return -EBUSY;
+	off = offset_in_page(uaddr);
+	if (off + len > PAGE_SIZE)
+		return -EINVAL;
+	page = up->pages[(uaddr >> PAGE_SHIFT) - (up->first >> PAGE_SHIFT)];
+	vaddr = page_address(page);
+	if (!vaddr)
+		return -EINVAL;
+	ctrler = dfudev->usbdev->bus->controller;
+	dmabuf = dma_map_page(ctrler, page, off, len, dir);
+	if (dma_mapping_error(ctrler, dmabuf))
+		return -ENOMEM;
+	ctrl = dfudev->opctrl[slot];
+	ctrl->datbuf = vaddr + off;
+	ctrl->dfurb->transfer_dma = dmabuf;
+	return 0;
+}
 
-	buflen = altrim(dfudev->xfersize, 4) + 2*sizeof(struct dfu_control);
-	datbuf = kmalloc(buflen, GFP_KERNEL);
-	if (!datbuf) {
-		retv = -ENOMEM;
-		goto err_10;
+static void dfu_zc_unmap(struct dfu1_device *dfudev, int slot, int len,
+			enum dma_data_direction dir)
+{
+	struct dfu_control *ctrl;
+
+	ctrl = dfudev->opctrl[slot];
+	if (ctrl->datbuf == dfudev->xferbuf[slot])
+		return;
+	dma_unmap_page(dfudev->usbdev->bus->controller,
+			ctrl->dfurb->transfer_dma, len, dir);
+	ctrl->datbuf = dfudev->xferbuf[slot];
+	ctrl->dfurb->transfer_dma = dfudev->xferdma[slot];
+}
+
+/*
+ * Allocate the controls of a device once at probe: DFU_NXFER transfer
+ * controls with coherent buffers and a status control for the open
+ * session, and DFU_NSYSCTRL controls borrowed by the sysfs handlers.
+ */
+static int dfu_alloc_ctrls(struct dfu1_device *dfudev)
+{
+	int retv, i, nctrl;
+	struct dfu_control *ctrl;
+
+	nctrl = DFU_NXFER + 1 + DFU_NSYSCTRL;
+	ctrl = kcalloc(nctrl, sizeof(struct dfu_control), GFP_KERNEL);
+	if (!ctrl)
+		return -ENOMEM;
+	dfudev->ctrlmem = ctrl;
+	dfudev->buflen = altrim(dfudev->maxxfer, 4);
+	for (i = 0; i < nctrl; i++, ctrl++) {
+		ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ctrl->dfurb) {
+			retv = -ENOMEM;
+			goto err_20;
+		}
+		ctrl->usbdev = dfudev->usbdev;
+		ctrl->intf = dfudev->intf;
+		ctrl->intfnum = dfudev->intfnum;
+		ctrl->stats = &dfudev->stats;
+		ctrl->pipelock = &dfudev->pipelock;
+		if (i >= DFU_NXFER)
+			continue;
+		ctrl->datbuf = usb_alloc_coherent(dfudev->usbdev,
+				dfudev->buflen, GFP_KERNEL,
+				&ctrl->dfurb->transfer_dma);
+		if (!ctrl->datbuf) {
+			usb_free_urb(ctrl->dfurb);
+			retv = -ENOMEM;
+			goto err_20;
+		}
+		ctrl->dfurb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		dfudev->xferbuf[i] = ctrl->datbuf;
+		dfudev->xferdma[i] = ctrl->dfurb->transfer_dma;
+		dfudev->opctrl[i] = ctrl;
 	}
-	dfudev->datbuf = datbuf;
-	dfudev->opctrl = datbuf + altrim(dfudev->xfersize, 4);
-	dfudev->opctrl->datbuf = datbuf;
-	dfudev->opctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dfudev->opctrl->dfurb) {
+	dfudev->utail = kmalloc(dfudev->buflen, GFP_KERNEL);
+	if (!dfudev->utail) {
 		retv = -ENOMEM;
 		goto err_20;
 	}
-	dfudev->opctrl->usbdev = dfudev->usbdev;
-	dfudev->opctrl->intf = dfudev->intf;
-	dfudev->opctrl->intfnum = dfudev->intfnum;
-	
-	dfudev->stctrl = dfudev->opctrl + 1;
-	dfudev->stctrl->datbuf = NULL;
-	dfudev->stctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dfudev->stctrl->dfurb) {
-		retv = -ENOMEM;
-		goto err_25;
+	dfudev->utlen = 0;
+	dfudev->stctrl = dfudev->ctrlmem + DFU_NXFER;
+	for (i = 0; i < DFU_NSYSCTRL; i++)
+		dfudev->sysctrl[i] = dfudev->stctrl + 1 + i;
+	dfudev->sysmap = 0;
+	init_waitqueue_head(&dfudev->syswait);
+	return 0;
+
+err_20:
+	while (--i >= 0) {
+		ctrl = dfudev->ctrlmem + i;
+		if (i < DFU_NXFER)
+			usb_free_coherent(dfudev->usbdev, dfudev->buflen,
+					dfudev->xferbuf[i], dfudev->xferdma[i]);
+		usb_free_urb(ctrl->dfurb);
+	}
+	kfree(dfudev->ctrlmem);
+	return retv;
+}
+
+static void dfu_free_ctrls(struct dfu1_device *dfudev)
+{
+	struct dfu_control *ctrl;
+	int i;
+
+	for (i = 0; i < DFU_NXFER + 1 + DFU_NSYSCTRL; i++) {
+		ctrl = dfudev->ctrlmem + i;
+		if (i < DFU_NXFER)
+			usb_free_coherent(dfudev->usbdev, dfudev->buflen,
+					dfudev->xferbuf[i], dfudev->xferdma[i]);
+		usb_free_urb(ctrl->dfurb);
+	}
+	kfree(dfudev->ctrlmem);
+	kfree(dfudev->utail);
+}
+
+static struct dfu_control *dfu_ctrl_try(struct dfu1_device *dfudev)
+{
+	int i;
+
+	for (i = 0; i < DFU_NSYSCTRL; i++)
+		if (!test_and_set_bit(i, &dfudev->sysmap))
+			return dfudev->sysctrl[i];
+	return NULL;
+}
+
+/*
+ * Borrow a control for a sysfs handler, waiting while all are in use.
+ * Returns NULL if interrupted.
+ */
+static struct dfu_control *dfu_ctrl_get(struct dfu1_device *dfudev)
+{
+	struct dfu_control *ctrl;
+
+	if (wait_event_interruptible(dfudev->syswait,
+				(ctrl = dfu_ctrl_try(dfudev)) != NULL))
+		return NULL;
+	return ctrl;
+}
+
+static void dfu_ctrl_put(struct dfu1_device *dfudev, struct dfu_control *ctrl)
+{
+	clear_bit(ctrl - dfudev->sysctrl[0], &dfudev->sysmap);
+	wake_up(&dfudev->syswait);
+}
+
+#define DFU_CLAIM_TRY		0
+#define DFU_CLAIM_WAIT		1
+#define DFU_CLAIM_INTR		2	/* wait, unless interrupted */
+
+/*
+ * Take ownership of the device for a session: an open file, the flash
+ * worker, or a sysfs write that changes how the device is driven. Only
+ * the owner moves the device through the DFU states. Queries need no
+ * ownership, their control transfers just take turns on the pipe lock.
+ */
+static int dfu_claim(struct dfu1_device *dfudev, int how)
+{
+	if (how == DFU_CLAIM_TRY)
+		return test_and_set_bit(0, &dfudev->owned) ? -EBUSY : 0;
+	if (how == DFU_CLAIM_WAIT) {
+		wait_event(dfudev->ownwait,
+				!test_and_set_bit(0, &dfudev->owned));
+		return 0;
 	}
-	dfudev->stctrl->usbdev = dfudev->usbdev;
-	dfudev->stctrl->intf = dfudev->intf;
-	dfudev->stctrl->intfnum = dfudev->intfnum;
+	if (wait_event_interruptible(dfudev->ownwait,
+				!test_and_set_bit(0, &dfudev->owned)))
+		return -ERESTARTSYS;
+	return 0;
+}
 
-	ctrl = dfudev->stctrl;
-	state = dfu_get_state(ctrl);
+static void dfu_unclaim(struct dfu1_device *dfudev)
+{
+	clear_bit(0, &dfudev->owned);
+	wake_up(&dfudev->ownwait);
+}
+
+/*
+ * Start a session on the preallocated controls. The caller owns the
+ * device for as long as the session lasts.
+ */
+static int dfu_session_start(struct dfu1_device *dfudev)
+{
+	int state;
+
+	dfudev->prog_done = 0;
+	dfudev->prog_total = 0;
+	dfudev->utlen = 0;
+	state = dfu_get_state(dfudev->stctrl);
+	if (dfudev->resume > 0 && state == dfuDNLOAD_IDLE) {
+		dev_info(&dfudev->intf->dev, "Resuming download at %lld\n",
+				dfudev->resume);
+		return 0;
+	}
+	dfudev->resume = -1;
 	if (state != dfuIDLE) {
 		dev_err(&dfudev->intf->dev, "Bad Initial State: %d\n", state);
-		retv =  -EBUSY;
-		goto err_30;
+		return -EBUSY;
 	}
+	return 0;
+}
 
-	return retv;
+static int dfu_manifest(struct dfu1_device *dfudev);
 
-err_30:
-	usb_free_urb(dfudev->stctrl->dfurb);
-err_25:
-	usb_free_urb(dfudev->opctrl->dfurb);
-err_20:
-	kfree(datbuf);
-err_10:
-	mutex_unlock(&dfudev->lock);
-	return retv;
+static void dfu_settle(struct dfu1_device *dfudev)
+{
+	int retv;
+
+	if (dfudev->quirk.release_ms)
+		msleep(dfudev->quirk.release_ms);
+	retv = dfu_get_state(dfudev->stctrl);
+	if (retv != dfuIDLE)
+		dev_err(&dfudev->intf->dev, "Need Reset! Stuck in State: %d\n",
+				retv);
 }
 
-static int dfu_release(struct inode *inode, struct file *filp)
+/* dfuERROR needs a CLRSTATUS, any other state but dfuIDLE an ABORT */
+static void dfu_back_to_idle(struct dfu1_device *dfudev, int state)
+{
+	if (state == dfuERROR)
+		dfu_clr_status(dfudev->stctrl);
+	else if (state != dfuIDLE)
+		dfu_abort(dfudev->stctrl);
+	else
+		return;
+	dfu_settle(dfudev);
+}
+
+/*
+ * Bring the device back to dfuIDLE. A pending download is finished and
+ * followed through manifestation at the pace the device asks for; a
+ * device that is not manifestation tolerant is left waiting for reset.
+ */
+static void dfu_session_end(struct dfu1_device *dfudev)
 {
-	struct dfu1_device *dfudev;
 	struct dfu_control *stctrl;
 	int retv;
 
-	dfudev = filp->private_data;
+	if (dfudev->resume > 0) {
+		dev_info(&dfudev->intf->dev,
+			"Download stopped at %lld, kept %d ms for resume\n",
+			dfudev->resume, resume_timeout);
+		queue_delayed_work(dfu_wq, &dfudev->rwork,
+				msecs_to_jiffies(resume_timeout));
+		return;
+	}
 	stctrl = dfudev->stctrl;
 	retv = dfu_get_state(stctrl);
-	if (retv == dfuDNLOAD_IDLE)
-		dfu_finish_dnload(stctrl);
-	else if (retv == dfuERROR)
-		dfu_clr_status(stctrl);
-	else if (retv != dfuIDLE)
-		dfu_abort(stctrl);
-	msleep(100);
-	retv = dfu_get_state(stctrl);
-	if (retv != dfuIDLE)
-		dev_err(&dfudev->intf->dev, "Need Reset! Stuck in State: %d\n",
-				retv);
-	usb_free_urb(stctrl->dfurb);
-	usb_free_urb(dfudev->opctrl->dfurb);
-	kfree(dfudev->datbuf);
-	mutex_unlock(&dfudev->lock);
+	if (retv == dfuDNLOAD_IDLE) {
+		retv = dfu_manifest(dfudev);
+		if (retv == dfuMANIFEST_WAIT_RESET) {
+			dev_info(&dfudev->intf->dev,
+				"Manifested, device waits for reset\n");
+			return;
+		}
+		if (retv < 0)
+			dev_err(&dfudev->intf->dev,
+				"Manifestation failed: %d\n", retv);
+		dfu_settle(dfudev);
+		return;
+	}
+	dfu_back_to_idle(dfudev, retv);
+}
+
+/* nobody came back for an interrupted download, abort it */
+static void dfu_resume_expire(struct work_struct *work)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = container_of(to_delayed_work(work), struct dfu1_device,
+				rwork);
+	dfu_claim(dfudev, DFU_CLAIM_WAIT);
+	if (dfudev->resume > 0) {
+		dev_info(&dfudev->intf->dev,
+			"Resume checkpoint expired, download aborted\n");
+		dfudev->resume = -1;
+		dfu_back_to_idle(dfudev, dfu_get_state(dfudev->stctrl));
+	}
+	dfu_unclaim(dfudev);
+}
+
+/* finish a session that dfu_release() left to the work queue */
+static void dfu_manifest_work(struct work_struct *work)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = container_of(work, struct dfu1_device, mwork);
+	dfu_claim(dfudev, DFU_CLAIM_WAIT);
+	dfu_session_end(dfudev);
+	dfudev->manifesting = 0;
+	dfu_unclaim(dfudev);
+}
+
+static int dfu_open(struct inode *inode, struct file *filp)
+{
+	struct dfu1_device *dfudev;
+	int retv;
+
+	dfudev = container_of(inode->i_cdev, struct dfu1_device, cdev);
+	filp->private_data = dfudev;
+	cancel_delayed_work_sync(&dfudev->rwork);
+	for (;;) {
+		if (dfu_claim(dfudev, DFU_CLAIM_INTR))
+			return -EBUSY;
+		if (!dfudev->manifesting)
+			break;
+		dfu_unclaim(dfudev);
+		flush_work(&dfudev->mwork);
+	}
+
+	retv = dfu_session_start(dfudev);
+	if (retv)
+		dfu_unclaim(dfudev);
+	return retv;
+}
+
+static void dfu_set_eventfd(struct dfu1_device *dfudev,
+			struct eventfd_ctx *evctx)
+{
+	struct eventfd_ctx *old;
+
+	spin_lock_irq(&dfudev->evlock);
+	old = dfudev->evctx;
+	dfudev->evctx = evctx;
+	spin_unlock_irq(&dfudev->evlock);
+	if (old)
+		eventfd_ctx_put(old);
+}
+
+static void dfu_stage_drop(struct dfu1_device *dfudev);
+
+static int dfu_release(struct inode *inode, struct file *filp)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = filp->private_data;
+	flush_work(&dfudev->awork);
+	dfu_stage_drop(dfudev);
+	if (dfudev->aerr)
+		dev_err(&dfudev->intf->dev, "Write behind failed: %d\n",
+				dfudev->aerr);
+	vfree(dfudev->abuf);
+	dfudev->abuf = NULL;
+	dfudev->adir = DFU_ASYNC_NONE;
+	dfudev->aerr = 0;
+	dfu_set_eventfd(dfudev, NULL);
+	if (async_manifest && dfudev->resume <= 0 &&
+			dfu_get_state(dfudev->stctrl) == dfuDNLOAD_IDLE) {
+		dfudev->manifesting = 1;
+		queue_work(dfu_wq, &dfudev->mwork);
+	} else
+		dfu_session_end(dfudev);
+	dfu_unclaim(dfudev);
 	filp->private_data = NULL;
 	return 0;
 }
 
-static ssize_t dfu_upload(struct file *filp, char __user *buff, size_t count,
-			loff_t *f_pos)
+static int dfu_up_copy(struct dfu1_device *dfudev, char __user *buff,
+			u8 *kbuf, struct iov_iter *to, size_t off, const void *src,
+			size_t len)
+{
+	if (kbuf) {
+		memcpy(kbuf + off, src, len);
+		return 0;
+	}
+	if (!buff)
+		return copy_to_iter(src, len, to) == len ? 0 : -EFAULT;
+	if (copy_to_user(buff + off, src, len)) {
+		dev_err(&dfudev->intf->dev,
+			"Failed to copy data into user space!\n");
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * Upload into user memory @buff, kernel memory @kbuf, or straight from
+ * the transfer buffer into @to, e.g. the pipe of a splice, when both
+ * are NULL.
+ *
+ * The device is always asked for whole blocks, so every request starts
+ * on a block boundary. What does not fit into @count of the last block
+ * is kept in utail and handed out first by the next upload from where
+ * this one stopped.
+ */
+static ssize_t dfu_upload_blocks(struct dfu1_device *dfudev,
+			char __user *buff, u8 *kbuf, struct iov_iter *to,
+			size_t count, loff_t *f_pos)
 {
-	struct dfu1_device *dfudev;
 	int blknum, numb;
 	struct dfu_control *opctrl, *stctrl;
-	int dfust, dma, len;
-	dma_addr_t dmabuf;
-	struct device *ctrler;
+	int dfust, len, left, zc, retv;
+	struct dfu_upages up;
 
 	if (count == 0)
 		return 0;
-	dfudev = filp->private_data;
-	opctrl = dfudev->opctrl;
+	if (buff && !access_ok(VERIFY_WRITE, buff, count))
+		return -EFAULT;
+	numb = 0;
+	if (dfudev->utlen && *f_pos == dfudev->utpos) {
+		numb = min_t(size_t, count, dfudev->utlen);
+		if (dfu_up_copy(dfudev, buff, kbuf, to, 0,
+				dfudev->utail + dfudev->utoff, numb))
+			return -EFAULT;
+		dfudev->utoff += numb;
+		dfudev->utlen -= numb;
+		dfudev->utpos += numb;
+		*f_pos += numb;
+		if (dfudev->utlen || dfudev->utend || numb == count)
+			return numb;
+	}
+	dfudev->utlen = 0;
+	opctrl = dfudev->opctrl[0];
 	stctrl = dfudev->stctrl;
 	dfust = dfu_get_state(stctrl);
 	if (dfust != dfuIDLE && dfust != dfuUPLOAD_IDLE) {
 		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
-		return -EINVAL;
+		return numb ? numb : -EINVAL;
 	}
 	if (*f_pos != 0 && dfust == dfuIDLE)
-		return 0;
+		return numb;
+	if (*f_pos % dfudev->xfersize)
+		return numb ? numb : -EINVAL;
 
-	if (!access_ok(VERIFY_WRITE, buff, count))
-		return -EFAULT;
+	zc = 0;
+	if (buff)
+		zc = dfu_pin_user(dfudev, &up, (unsigned long)buff, count,
+					1) == 0;
 
-	ctrler = dfudev->usbdev->bus->controller;
-	dmabuf = ~0;
-	dma = 0;
 	opctrl->req.bRequestType = 0xa1;
 	opctrl->req.bRequest = USB_DFU_UPLOAD;
 	opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
 	opctrl->req.wLength = cpu_to_le16(dfudev->xfersize);
 	opctrl->pipe = usb_rcvctrlpipe(dfudev->usbdev, 0);
 	opctrl->len = dfudev->xfersize;
-	if (dfudev->dma) {
-		dmabuf = dma_map_single(ctrler, opctrl->datbuf,
-				dfudev->xfersize, DMA_FROM_DEVICE);
-		if (!dma_mapping_error(ctrler, dmabuf)) {
-			dma = 1;
-			opctrl->dfurb->transfer_flags |=
-						URB_NO_TRANSFER_DMA_MAP;
-			opctrl->dfurb->transfer_dma = dmabuf;
-		} else
-			dev_warn(&dfudev->intf->dev,
-					"Cannot map DMA address\n");
-	}
 
-	blknum = *f_pos / BLKSIZE;
-	numb = 0;
+	blknum = *f_pos / dfudev->xfersize;
 	do {
+		left = count - numb;
+		if (zc && left >= opctrl->len)
+			dfu_zc_map(dfudev, &up, 0, (unsigned long)(buff+numb),
+					opctrl->len, DMA_FROM_DEVICE);
 		opctrl->req.wValue = cpu_to_le16(blknum);
-		if (dfu_submit_urb(opctrl, urb_timeout) ||
-				dfu_get_status(stctrl))
-			break;
-		dfust = stctrl->dfuStatus.bState;
-		if (dfust != dfuUPLOAD_IDLE && dfust != dfuIDLE) {
-			dev_err(&dfudev->intf->dev,
-				"Uploading failed. DFU State: %d\n", dfust);
+		retv = dfu_submit_urb(opctrl, urb_timeout);
+		len = min_t(int, READ_ONCE(opctrl->nxfer), opctrl->len);
+		if (opctrl->datbuf == dfudev->xferbuf[0]) {
+			/* never more than is left of @count, keep the rest */
+			if (retv == 0 && len > 0 &&
+			    dfu_up_copy(dfudev, buff, kbuf, to, numb,
+					opctrl->datbuf, min(len, left)))
+				break;
+			if (retv == 0 && len > left) {
+				memcpy(dfudev->utail, opctrl->datbuf + left,
+						len - left);
+				dfudev->utoff = 0;
+			}
+		} else
+			dfu_zc_unmap(dfudev, 0, opctrl->len, DMA_FROM_DEVICE);
+		if (retv) {
+			if (dfudev->fastup && dfu_get_status(stctrl) == 0)
+				dev_err(&dfudev->intf->dev,
+					"Uploading failed. DFU State: %d\n",
+					(int)stctrl->dfuStatus.bState);
 			break;
 		}
-		len = READ_ONCE(opctrl->nxfer);
+		/*
+		 * In fast upload mode only a short block, which ends the
+		 * upload, is followed by GETSTATUS.
+		 */
+		if (dfudev->fastup && len == opctrl->len) {
+			dfust = dfuUPLOAD_IDLE;
+		} else {
+			if (dfu_get_status(stctrl))
+				break;
+			dfust = stctrl->dfuStatus.bState;
+			if (dfust != dfuUPLOAD_IDLE && dfust != dfuIDLE) {
+				dev_err(&dfudev->intf->dev,
+					"Uploading failed. DFU State: %d\n",
+					dfust);
+				break;
+			}
+		}
 		if (len == 0)
 			break;
-		*f_pos += len;
-		blknum = *f_pos / BLKSIZE;
-		dma_sync_single_for_cpu(ctrler, dmabuf, len, DMA_FROM_DEVICE);
-		if (copy_to_user(buff+numb, opctrl->datbuf, len)) {
-			dev_err(&dfudev->intf->dev,
-				"Failed to copy data into user space!\n");
-			break;
+		dfu_count_xfer(dfudev, 1, len);
+		if (len > left) {
+			dfudev->utlen = len - left;
+			dfudev->utend = dfust != dfuUPLOAD_IDLE;
+			len = left;
 		}
+		*f_pos += len;
+		blknum = *f_pos / dfudev->xfersize;
 		numb += len;
+		dfudev->utpos = *f_pos;
 	} while (numb < count && dfust == dfuUPLOAD_IDLE);
 
-	if (dma)
-		dma_unmap_single(ctrler, dmabuf, dfudev->xfersize,
-				DMA_FROM_DEVICE);
-
+	if (zc)
+		dfu_unpin_user(&up);
 	return numb;
 }
 
-static ssize_t dfu_dnload(struct file *filp, const char __user *buff,
-			size_t count, loff_t *f_pos)
+static ssize_t dfu_upload(struct file *filp, char __user *buff, size_t count,
+			loff_t *f_pos)
 {
-	struct dfu1_device *dfudev;
-	int blknum, numb, fpos;
-	struct dfu_control *opctrl, *stctrl;
-	int dfust, dma, len, lenrem, tmout;
-	dma_addr_t dmabuf;
-	struct device *ctrler;
+	return dfu_upload_blocks(filp->private_data, buff, NULL, NULL, count,
+				f_pos);
+}
 
-	if (count == 0)
-		return 0;
-	dfudev = filp->private_data;
-	opctrl = dfudev->opctrl;
-	stctrl = dfudev->stctrl;
-	dfust = dfu_get_state(stctrl);
-	if (dfust != dfuIDLE && dfust != dfuDNLOAD_IDLE) {
-		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
-		return -EINVAL;
+/*
+ * Upload cache. A complete upload is kept in memory under the serial
+ * and alternate setting of the device and the generation of its flash.
+ * Each device takes a new generation from dfu_upgen at probe and with
+ * every DNLOAD, so a cached image is only ever served for flash that has
+ * not been written since it was read. Least recently used first out,
+ * within upload_cache KiB for all devices.
+ */
+struct dfu_upcache {
+	struct kref ref;
+	struct list_head list;		/* on dfu_uclist */
+	u32 gen;
+	int alt;
+	size_t len;
+	u8 *data;
+	char serial[];
+};
+
+static LIST_HEAD(dfu_uclist);		/* most recently used first */
+static DEFINE_MUTEX(dfu_uclock);	/* protects dfu_uclist, dfu_ucbytes */
+static size_t dfu_ucbytes;
+static atomic_t dfu_upgen = ATOMIC_INIT(0);
+
+static void dfu_uc_release(struct kref *ref)
+{
+	struct dfu_upcache *uc;
+
+	uc = container_of(ref, struct dfu_upcache, ref);
+	vfree(uc->data);
+	kfree(uc);
+}
+
+static inline void dfu_uc_put(struct dfu_upcache *uc)
+{
+	kref_put(&uc->ref, dfu_uc_release);
+}
+
+/* the caller holds dfu_uclock */
+static void dfu_uc_unlink(struct dfu_upcache *uc)
+{
+	list_del(&uc->list);
+	dfu_ucbytes -= uc->len;
+	dfu_uc_put(uc);
+}
+
+static struct dfu_upcache *dfu_uc_get(struct dfu1_device *dfudev)
+{
+	struct dfu_upcache *uc;
+	const char *serial;
+	int alt;
+
+	serial = dfudev->usbdev->serial;
+	if (!serial || upload_cache <= 0)
+		return NULL;
+	alt = dfudev->intf->cur_altsetting->desc.bAlternateSetting;
+	mutex_lock(&dfu_uclock);
+	list_for_each_entry(uc, &dfu_uclist, list) {
+		if (uc->gen == dfudev->upgen && uc->alt == alt &&
+				strcmp(uc->serial, serial) == 0) {
+			list_move(&uc->list, &dfu_uclist);
+			kref_get(&uc->ref);
+			goto exit_10;
+		}
 	}
-	if (!access_ok(VERIFY_READ, buff, count))
-		return -EFAULT;
+	uc = NULL;
+exit_10:
+	mutex_unlock(&dfu_uclock);
+	return uc;
+}
 
-	ctrler = dfudev->usbdev->bus->controller;
-	dmabuf = ~0;
-	dma = 0;
-	opctrl->req.bRequestType = 0x21;
-	opctrl->req.bRequest = USB_DFU_DNLOAD;
+/* drop what is cached for @serial */
+static void dfu_uc_drop(const char *serial)
+{
+	struct dfu_upcache *uc, *tmp;
+
+	mutex_lock(&dfu_uclock);
+	list_for_each_entry_safe(uc, tmp, &dfu_uclist, list)
+		if (strcmp(uc->serial, serial) == 0)
+			dfu_uc_unlink(uc);
+	mutex_unlock(&dfu_uclock);
+}
+
+/*
+ * The device is about to be downloaded to. A vendor command, such as the
+ * Tiva READ, may also change what the next upload returns, so that one
+ * upload is not cached.
+ */
+static void dfu_uc_invalidate(struct dfu1_device *dfudev, int cmd)
+{
+	dfudev->upgen = atomic_inc_return(&dfu_upgen);
+	if (cmd)
+		dfudev->ucskip = 1;
+	if (dfudev->usbdev->serial && !list_empty(&dfu_uclist))
+		dfu_uc_drop(dfudev->usbdev->serial);
+}
+
+static int dfu_uc_add(struct dfu1_device *dfudev, u8 *data, size_t len)
+{
+	struct dfu_upcache *uc, *old, *tmp;
+	const char *serial;
+	size_t limit;
+
+	serial = dfudev->usbdev->serial;
+	limit = (size_t)upload_cache << 10;
+	if (len > limit)
+		return -EFBIG;
+	uc = kmalloc(sizeof(struct dfu_upcache) + strlen(serial) + 1,
+			GFP_KERNEL);
+	if (!uc)
+		return -ENOMEM;
+	kref_init(&uc->ref);
+	uc->gen = dfudev->upgen;
+	uc->alt = dfudev->intf->cur_altsetting->desc.bAlternateSetting;
+	uc->len = len;
+	uc->data = data;
+	strcpy(uc->serial, serial);
+
+	mutex_lock(&dfu_uclock);
+	list_for_each_entry_safe(old, tmp, &dfu_uclist, list)
+		if (old->alt == uc->alt && strcmp(old->serial, serial) == 0)
+			dfu_uc_unlink(old);
+	while (!list_empty(&dfu_uclist) && dfu_ucbytes + len > limit)
+		dfu_uc_unlink(list_last_entry(&dfu_uclist, struct dfu_upcache,
+						list));
+	list_add(&uc->list, &dfu_uclist);
+	dfu_ucbytes += len;
+	mutex_unlock(&dfu_uclock);
+	return 0;
+}
+
+#define DFU_UC_CHUNK	64	/* blocks in the first fill buffer */
+
+/* upload the whole image into the cache, in dfuIDLE of a session */
+static int dfu_uc_fill(struct dfu1_device *dfudev)
+{
+	size_t size, pos, limit;
+	loff_t fpos;
+	ssize_t numb;
+	u8 *buf, *nbuf;
+	int retv;
+
+	/* room for one more block, to see the short one that ends it */
+	limit = min_t(size_t, (size_t)upload_cache << 10, DFU_MAX_IMAGE);
+	limit = roundup(limit, dfudev->xfersize) + dfudev->xfersize;
+	size = min_t(size_t, (size_t)dfudev->xfersize * DFU_UC_CHUNK, limit);
+	buf = vmalloc(size);
+	if (!buf)
+		return -ENOMEM;
+	pos = 0;
+	fpos = 0;
+	for (;;) {
+		if (pos == size) {
+			retv = -EFBIG;
+			if (size >= limit)
+				break;
+			retv = -ENOMEM;
+			size = min(2*size, limit);
+			nbuf = vmalloc(size);
+			if (!nbuf)
+				break;
+			memcpy(nbuf, buf, pos);
+			vfree(buf);
+			buf = nbuf;
+		}
+		numb = dfu_upload_blocks(dfudev, NULL, buf + pos, NULL,
+					size - pos, &fpos);
+		if (numb < 0) {
+			retv = numb;
+			break;
+		}
+		pos += numb;
+		if (pos < size) {
+			retv = dfu_uc_add(dfudev, buf, pos);
+			if (retv == 0)
+				return 0;
+			break;
+		}
+	}
+	vfree(buf);
+	if (dfu_get_state(dfudev->stctrl) != dfuIDLE)
+		dfu_abort(dfudev->stctrl);
+	return retv;
+}
+
+/*
+ * The cached image of the device, filled now when it is not cached yet.
+ * An image that did not fit is not tried again in the same generation.
+ */
+static struct dfu_upcache *dfu_uc_load(struct dfu1_device *dfudev)
+{
+	struct dfu_upcache *uc;
+	int retv;
+
+	uc = dfu_uc_get(dfudev);
+	if (uc || !dfudev->usbdev->serial || upload_cache <= 0)
+		return uc;
+	if (dfudev->ucskip || dfudev->ucbad == dfudev->upgen) {
+		dfudev->ucskip = 0;
+		return NULL;
+	}
+	/* only an upload from its start is the whole image */
+	if (dfu_get_state(dfudev->stctrl) != dfuIDLE)
+		return NULL;
+	retv = dfu_uc_fill(dfudev);
+	if (retv) {
+		dev_info(&dfudev->intf->dev, "Upload not cached: %d\n", retv);
+		dfudev->ucbad = dfudev->upgen;
+		return NULL;
+	}
+	return dfu_uc_get(dfudev);
+}
+
+static ssize_t dfu_uc_read(struct dfu_upcache *uc, struct kiocb *iocb,
+			struct iov_iter *to)
+{
+	size_t len;
+
+	if (iocb->ki_pos >= uc->len)
+		return 0;
+	len = min_t(size_t, uc->len - iocb->ki_pos, iov_iter_count(to));
+	len = copy_to_iter(uc->data + iocb->ki_pos, len, to);
+	if (len == 0 && iov_iter_count(to))
+		return -EFAULT;
+	iocb->ki_pos += len;
+	return len;
+}
+
+static inline unsigned int dfu_poll_usecs(struct dfu1_device *dfudev,
+			struct dfu_status *st)
+{
+	if (dfudev->quirk.poll_ms)
+		return dfudev->quirk.poll_ms * USEC_PER_MSEC;
+	return (st->wmsec[0] | (st->wmsec[1] << 8) | (st->wmsec[2] << 16))
+			* USEC_PER_MSEC;
+}
+
+static void dfu_poll_sleep(unsigned int usec)
+{
+	if (poll_mode == 0)
+		msleep(DIV_ROUND_UP(usec, USEC_PER_MSEC));
+	else if (usec)
+		usleep_range(usec, usec + (usec >> 3) + 50);
+}
+
+/*
+ * Wait out dfuDNLOAD_BUSY. In adaptive mode the first poll lands at the
+ * busy time learned from earlier blocks rather than the device's, often
+ * conservative, bwPollTimeout, and later polls come at a fraction of it.
+ */
+static int dfu_wait_busy(struct dfu1_device *dfudev, struct dfu_control *stctrl)
+{
+	unsigned int usec, tmout, polls;
+	ktime_t start;
+	int retv = 0;
+
+	start = ktime_get();
+	polls = 0;
+	while (stctrl->dfuStatus.bState == dfuDNLOAD_BUSY) {
+		tmout = dfu_poll_usecs(dfudev, &stctrl->dfuStatus);
+		usec = tmout;
+		if (poll_mode == 2 && dfudev->busy_us) {
+			if (polls == 0)
+				usec = dfudev->busy_us;
+			else
+				usec = max(dfudev->busy_us >> 2, 200U);
+			if (usec > tmout)
+				usec = tmout;
+		}
+		dfu_poll_sleep(usec);
+		polls++;
+		retv = dfu_get_status(stctrl);
+		if (retv)
+			break;
+	}
+	if (polls) {
+		usec = ktime_us_delta(ktime_get(), start);
+		spin_lock_irq(&dfudev->stats.lock);
+		dfudev->stats.busy_total_us += usec;
+		dfudev->stats.busy_polls += polls;
+		if (usec > dfudev->stats.busy_max_us)
+			dfudev->stats.busy_max_us = usec;
+		spin_unlock_irq(&dfudev->stats.lock);
+	}
+	if (polls && retv == 0) {
+		if (dfudev->busy_us)
+			dfudev->busy_us = (7*dfudev->busy_us + usec) >> 3;
+		else
+			dfudev->busy_us = usec;
+	}
+	return retv;
+}
+
+/* where dfu_dnload_blocks() takes the image from */
+struct dfu_src {
+	const char __user *ubuf;	/* user memory, or */
+	const u8 *kbuf;			/* kernel memory */
+	size_t len;
+};
+
+/*
+ * Load the block at @off into a transfer slot, either by pointing it at
+ * the pinned user page or by copying into the bounce buffer. Returns the
+ * block length, 0 when nothing is left, or -EFAULT.
+ */
+static int dfu_stage_block(struct dfu1_device *dfudev, int slot,
+			struct dfu_src *src, size_t off,
+			struct dfu_upages *up)
+{
+	struct dfu_control *ctrl;
+	int len;
+
+	ctrl = dfudev->opctrl[slot];
+	dfu_zc_unmap(dfudev, slot, ctrl->len, DMA_TO_DEVICE);
+	if (off >= src->len)
+		return 0;
+	len = src->len - off > dfudev->xfersize ? dfudev->xfersize :
+							src->len - off;
+	if (src->kbuf) {
+		memcpy(ctrl->datbuf, src->kbuf + off, len);
+		return len;
+	}
+	if (up && dfu_zc_map(dfudev, up, slot, (unsigned long)(src->ubuf + off),
+				len, DMA_TO_DEVICE) == 0)
+		return len;
+	if (copy_from_user(ctrl->datbuf, src->ubuf + off, len))
+		return -EFAULT;
+	return len;
+}
+
+static inline int dfu_transient(int err)
+{
+	return err == -EPIPE || err == -ETIMEDOUT || err == -ECONNRESET ||
+		err == -ENOENT || err == -EPROTO || err == -EILSEQ ||
+		err == -EOVERFLOW;
+}
+
+static void dfu_retry_backoff(struct dfu1_device *dfudev, int tries)
+{
+	msleep(min(DFU_RETRY_MSEC << tries, DFU_RETRY_MAXMSEC));
+	spin_lock_irq(&dfudev->stats.lock);
+	dfudev->stats.retries++;
+	spin_unlock_irq(&dfudev->stats.lock);
+}
+
+/*
+ * After a transient failure of a DNLOAD, back off and bring the device to
+ * a state that takes the block again. A stall leaves the device in
+ * dfuERROR, which CLRSTATUS clears into dfuIDLE; a DNLOAD there starts a
+ * new download, so only a block that started the download (@restart) is
+ * sent again from dfuIDLE. Returns 0 if the block should be sent again.
+ */
+static int dfu_dnload_retry(struct dfu1_device *dfudev, int err, int tries,
+			int restart)
+{
+	struct dfu_control *stctrl;
+
+	if (tries >= dnload_retries || !dfu_transient(err))
+		return err;
+	dfu_retry_backoff(dfudev, tries);
+	stctrl = dfudev->stctrl;
+	if (dfu_get_status(stctrl))
+		return err;
+	switch (stctrl->dfuStatus.bState) {
+	case dfuERROR:
+		if (dfu_clr_status(stctrl) || !restart)
+			return err;
+		break;
+	case dfuDNLOAD_BUSY:
+		if (dfu_wait_busy(dfudev, stctrl))
+			return err;
+		break;
+	case dfuIDLE:
+		if (!restart)
+			return err;
+		break;
+	case dfuDNLOAD_IDLE:
+		break;
+	default:
+		return err;
+	}
+	dev_warn(&dfudev->intf->dev, "Resending block after error %d\n", err);
+	return 0;
+}
+
+/*
+ * The device took the block, only the GETSTATUS after it failed: ask
+ * again instead of sending the block a second time.
+ */
+static int dfu_status_retry(struct dfu1_device *dfudev, int err)
+{
+	int tries;
+
+	for (tries = 0; tries < dnload_retries && dfu_transient(err);
+			tries++) {
+		dfu_retry_backoff(dfudev, tries);
+		err = dfu_get_status(dfudev->stctrl);
+	}
+	return err;
+}
+
+/*
+ * Download is pipelined over DFU_NXFER transfer buffers: while block N
+ * is on the wire, or the device is busy writing it, block N+1 is staged
+ * into the other buffer. Returns the number of bytes the device took.
+ *
+ * If the download stops short with the device in dfuDNLOAD_IDLE, the
+ * file position up to which the device acknowledged the data is kept in
+ * dfudev->resume. Data below it is
+ * skipped when the download is started over, in this session or the
+ * next one.
+ */
+static size_t dfu_dnload_blocks(struct dfu1_device *dfudev,
+			struct dfu_src *src, loff_t fpos)
+{
+	struct dfu_control *opctrl, *nxctrl, *stctrl;
+	int blknum, dfust, len, cur, nxt, i, retv, tries, staged, restart;
+	struct dfu_upages up, *upp;
+	size_t numb;
+	u32 crc;
+
+	stctrl = dfudev->stctrl;
+	dfudev->dcrc_n = 0;
+	dfudev->utlen = 0;
+	dfu_uc_invalidate(dfudev, 0);
+	upp = NULL;
+	if (src->ubuf && dfu_pin_user(dfudev, &up, (unsigned long)src->ubuf,
+					src->len, 0) == 0)
+		upp = &up;
+
+	for (i = 0; i < DFU_NXFER; i++) {
+		opctrl = dfudev->opctrl[i];
+		opctrl->req.bRequestType = 0x21;
+		opctrl->req.bRequest = USB_DFU_DNLOAD;
+		opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
+		opctrl->pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
+	}
+
+	numb = 0;
+	if (dfudev->resume > 0 && fpos < dfudev->resume) {
+		numb = min_t(size_t, dfudev->resume - fpos, src->len);
+		fpos += numb;
+		WRITE_ONCE(dfudev->prog_done, dfudev->prog_done + numb);
+	}
+	spin_lock_irq(&dfudev->stats.lock);
+	if (fpos == 0) {
+		dfudev->dsum = ~0;
+		dfudev->dsum_len = 0;
+	} else if (fpos != dfudev->dsum_len) {
+		dfudev->dsum_len = -1;
+	}
+	spin_unlock_irq(&dfudev->stats.lock);
+	blknum = fpos / dfudev->xfersize;
+	restart = fpos == 0 && dfu_get_state(stctrl) == dfuIDLE;
+	tries = 0;
+	staged = 0;
+	cur = 0;
+	opctrl = dfudev->opctrl[cur];
+	opctrl->len = dfu_stage_block(dfudev, cur, src, numb, upp);
+	while (opctrl->len > 0) {
+		opctrl->req.wValue = cpu_to_le16(blknum);
+		opctrl->req.wLength = cpu_to_le16(opctrl->len);
+		nxt = (cur + 1) % DFU_NXFER;
+		nxctrl = dfudev->opctrl[nxt];
+		retv = dfu_start_urb(opctrl);
+		if (retv == 0) {
+			if (!staged)
+				nxctrl->len = dfu_stage_block(dfudev, nxt, src,
+						numb + opctrl->len, upp);
+			staged = 1;
+			retv = dfu_wait_urb(opctrl, urb_timeout);
+		}
+		if (retv) {
+			if (dfu_dnload_retry(dfudev, retv, tries++,
+						restart && fpos == 0) == 0)
+				continue;
+			break;
+		}
+		retv = dfu_get_status(stctrl);
+		if (retv)
+			retv = dfu_status_retry(dfudev, retv);
+		if (retv)
+			break;
+		tries = 0;
+		staged = 0;
+		len = READ_ONCE(opctrl->nxfer);
+		if (len == 0)
+			break;
+		if (dfudev->dsum_len >= 0) {
+			crc = crc32(dfudev->dsum, opctrl->datbuf, len);
+			spin_lock_irq(&dfudev->stats.lock);
+			dfudev->dsum = crc;
+			dfudev->dsum_len += len;
+			spin_unlock_irq(&dfudev->stats.lock);
+		}
+		numb += len;
+		fpos += len;
+		blknum = fpos / dfudev->xfersize;
+		WRITE_ONCE(dfudev->prog_done, dfudev->prog_done + len);
+		dfu_count_xfer(dfudev, 0, len);
+		dfu_wait_busy(dfudev, stctrl);
+		dfust = stctrl->dfuStatus.bState;
+		if (dfust != dfuDNLOAD_IDLE && dfust != dfuIDLE) {
+			dev_err(&dfudev->intf->dev,
+				"Downloading failed. DFU State: %d\n", dfust);
+			break;
+		}
+		/* a short transfer leaves the staged block misaligned */
+		if (len != opctrl->len)
+			nxctrl->len = dfu_stage_block(dfudev, nxt, src, numb,
+							upp);
+		cur = nxt;
+		opctrl = nxctrl;
+	}
+	/* only a device still waiting in dfuDNLOAD_IDLE can pick up again */
+	if (numb < src->len && dfu_get_state(stctrl) == dfuDNLOAD_IDLE)
+		dfudev->resume = fpos;
+	else if (numb < src->len || fpos > dfudev->resume)
+		dfudev->resume = -1;
+
+	for (i = 0; i < DFU_NXFER; i++)
+		dfu_zc_unmap(dfudev, i, dfudev->opctrl[i]->len, DMA_TO_DEVICE);
+	if (upp)
+		dfu_unpin_user(upp);
+	return numb;
+}
+
+static int dfu_dnload_ready(struct dfu1_device *dfudev)
+{
+	int dfust;
+
+	dfust = dfu_get_state(dfudev->stctrl);
+	if (dfust != dfuIDLE && dfust != dfuDNLOAD_IDLE) {
+		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static ssize_t dfu_dnload(struct file *filp, const char __user *buff,
+			size_t count, loff_t *f_pos)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_src src;
+	size_t numb;
+	int dfust;
+
+	if (count == 0)
+		return 0;
+	dfudev = filp->private_data;
+	dfust = dfu_dnload_ready(dfudev);
+	if (dfust)
+		return dfust;
+	if (!access_ok(VERIFY_READ, buff, count))
+		return -EFAULT;
+
+	src.ubuf = buff;
+	src.kbuf = NULL;
+	src.len = count;
+	numb = dfu_dnload_blocks(dfudev, &src, *f_pos);
+	if (*f_pos != 0 || numb > 32)
+		*f_pos += numb;
+
+	return numb;
+}
+
+/*
+ * Send the zero length DNLOAD that ends a download and follow the device
+ * through manifestation. Returns the state it settles in, or an error.
+ */
+static int dfu_manifest(struct dfu1_device *dfudev)
+{
+	struct dfu_control *stctrl;
+	unsigned long deadline;
+	int retv, dfust;
+
+	stctrl = dfudev->stctrl;
+	dfu_uc_invalidate(dfudev, 0);
+	retv = dfu_finish_dnload(stctrl);
+	if (retv)
+		return retv;
+	deadline = jiffies + msecs_to_jiffies(DFU_MANIFEST_TMOUT);
+	dfust = dfuMANIFEST_SYNC;
+	while (dfust == dfuMANIFEST_SYNC || dfust == dfuMANIFEST) {
+		if (time_after(jiffies, deadline))
+			return -ETIMEDOUT;
+		retv = dfu_get_status(stctrl);
+		if (retv) {
+			/* not manifestation tolerant, gone to wait for reset */
+			if (dfust == dfuMANIFEST && !dfudev->manifest)
+				return dfuMANIFEST_WAIT_RESET;
+			return retv;
+		}
+		dfust = stctrl->dfuStatus.bState;
+		if (dfust == dfuMANIFEST_SYNC || dfust == dfuMANIFEST)
+			dfu_poll_sleep(dfu_poll_usecs(dfudev,
+						&stctrl->dfuStatus));
+	}
+	return dfust;
+}
+
+/*
+ * Read the image back and compare it with @src. The second transfer
+ * buffer is idle during an upload and holds the user data to compare.
+ */
+static int dfu_verify_blocks(struct dfu1_device *dfudev, struct dfu_src *src)
+{
+	struct dfu_control *opctrl, *stctrl;
+	int blknum, len, dfust, retv;
+	const void *cmpbuf;
+	size_t off;
+
+	opctrl = dfudev->opctrl[0];
+	stctrl = dfudev->stctrl;
+	opctrl->req.bRequestType = 0xa1;
+	opctrl->req.bRequest = USB_DFU_UPLOAD;
 	opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
-	opctrl->pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
-	if (dfudev->dma) {
-		dmabuf = dma_map_single(ctrler, opctrl->datbuf, dfudev->xfersize,
-					DMA_TO_DEVICE);
-		if (!dma_mapping_error(ctrler, dmabuf)) {
-			dma = 1;
-			opctrl->dfurb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-			opctrl->dfurb->transfer_dma = dmabuf;
-		} else
-			dev_warn(&dfudev->intf->dev,
-					"Cannot map DMA address\n");
+	opctrl->req.wLength = cpu_to_le16(dfudev->xfersize);
+	opctrl->pipe = usb_rcvctrlpipe(dfudev->usbdev, 0);
+	opctrl->len = dfudev->xfersize;
+
+	retv = 0;
+	dfust = dfuUPLOAD_IDLE;
+	blknum = 0;
+	off = 0;
+	while (off < src->len) {
+		opctrl->req.wValue = cpu_to_le16(blknum);
+		retv = dfu_submit_urb(opctrl, urb_timeout);
+		if (retv)
+			break;
+		len = READ_ONCE(opctrl->nxfer);
+		if (!dfudev->fastup || len < opctrl->len) {
+			retv = dfu_get_status(stctrl);
+			if (retv)
+				break;
+			dfust = stctrl->dfuStatus.bState;
+			if (dfust != dfuUPLOAD_IDLE && dfust != dfuIDLE) {
+				retv = -EIO;
+				break;
+			}
+		}
+		if (len == 0)
+			break;
+		if (len > src->len - off)
+			len = src->len - off;
+		if (src->kbuf) {
+			cmpbuf = src->kbuf + off;
+		} else {
+			cmpbuf = dfudev->xferbuf[1];
+			if (copy_from_user(dfudev->xferbuf[1], src->ubuf + off,
+						len)) {
+				retv = -EFAULT;
+				break;
+			}
+		}
+		if (memcmp(cmpbuf, opctrl->datbuf, len)) {
+			dev_err(&dfudev->intf->dev,
+				"Verify failed at block %d\n", blknum);
+			retv = -EILSEQ;
+			break;
+		}
+		off += len;
+		blknum = off / dfudev->xfersize;
+		WRITE_ONCE(dfudev->prog_done, dfudev->prog_done + len);
+		dfu_count_xfer(dfudev, 1, len);
+	}
+	if (retv == 0 && off < src->len) {
+		dev_err(&dfudev->intf->dev, "Verify read back only %zu bytes\n",
+				off);
+		retv = -EILSEQ;
+	}
+	if (dfu_get_state(stctrl) == dfuUPLOAD_IDLE)
+		dfu_abort(stctrl);
+	return retv;
+}
+
+/*
+ * Read back as many bytes as were downloaded and digest them as they
+ * come in, without copying them anywhere.
+ */
+static int dfu_verify_digest(struct dfu1_device *dfudev,
+			struct dfu_verify *ver)
+{
+	struct dfu_control *opctrl, *stctrl;
+	int blknum, len, dfust, retv;
+	size_t off;
+	u32 crc;
+
+	if (dfudev->dsum_len <= 0)
+		return -ENODATA;
+	dfust = dfu_get_state(dfudev->stctrl);
+	if (dfust != dfuIDLE) {
+		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
+		return -EINVAL;
+	}
+	ver->len = dfudev->dsum_len;
+	ver->crc = ~dfudev->dsum;
+
+	opctrl = dfudev->opctrl[0];
+	stctrl = dfudev->stctrl;
+	opctrl->req.bRequestType = 0xa1;
+	opctrl->req.bRequest = USB_DFU_UPLOAD;
+	opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
+	opctrl->req.wLength = cpu_to_le16(dfudev->xfersize);
+	opctrl->pipe = usb_rcvctrlpipe(dfudev->usbdev, 0);
+	opctrl->len = dfudev->xfersize;
+
+	WRITE_ONCE(dfudev->prog_done, 0);
+	WRITE_ONCE(dfudev->prog_total, ver->len);
+	retv = 0;
+	crc = ~0;
+	blknum = 0;
+	off = 0;
+	while (off < ver->len) {
+		opctrl->req.wValue = cpu_to_le16(blknum);
+		retv = dfu_submit_urb(opctrl, urb_timeout);
+		if (retv)
+			break;
+		len = READ_ONCE(opctrl->nxfer);
+		if (!dfudev->fastup || len < opctrl->len) {
+			retv = dfu_get_status(stctrl);
+			if (retv)
+				break;
+			dfust = stctrl->dfuStatus.bState;
+			if (dfust != dfuUPLOAD_IDLE && dfust != dfuIDLE) {
+				retv = -EIO;
+				break;
+			}
+		}
+		if (len == 0)
+			break;
+		if (len > ver->len - off)
+			len = ver->len - off;
+		crc = crc32(crc, opctrl->datbuf, len);
+		off += len;
+		blknum = off / dfudev->xfersize;
+		WRITE_ONCE(dfudev->prog_done, off);
+		dfu_count_xfer(dfudev, 1, len);
+	}
+	if (dfu_get_state(stctrl) == dfuUPLOAD_IDLE)
+		dfu_abort(stctrl);
+	if (retv)
+		return retv;
+
+	ver->upcrc = ~crc;
+	ver->match = off == ver->len && ver->upcrc == ver->crc;
+	if (!ver->match)
+		dev_err(&dfudev->intf->dev,
+			"Verify failed, read back %zu bytes, CRC32 %08x\n",
+			off, ver->upcrc);
+	return 0;
+}
+
+static int dfu_ioctl_verify(struct dfu1_device *dfudev, void __user *argp)
+{
+	struct dfu_verify ver;
+	int retv;
+
+	memset(&ver, 0, sizeof(ver));
+	retv = dfu_verify_digest(dfudev, &ver);
+	if (retv)
+		return retv;
+	if (copy_to_user(argp, &ver, sizeof(ver)))
+		return -EFAULT;
+	return 0;
+}
+
+static int dfu_read_image(unsigned int fd, struct dfu_src *src)
+{
+	struct fd f;
+	loff_t size, pos;
+	ssize_t numb;
+	void *buf;
+
+	f = fdget(fd);
+	if (!f.file)
+		return -EBADF;
+	size = i_size_read(file_inode(f.file));
+	if (src->len == 0 || src->len > size)
+		src->len = size;
+	if (src->len == 0 || src->len > DFU_MAX_IMAGE) {
+		fdput(f);
+		return -EINVAL;
+	}
+	buf = vmalloc(src->len);
+	if (!buf) {
+		fdput(f);
+		return -ENOMEM;
+	}
+	pos = 0;
+	numb = kernel_read(f.file, buf, src->len, &pos);
+	fdput(f);
+	if (numb != src->len) {
+		vfree(buf);
+		return numb < 0 ? numb : -EIO;
+	}
+	src->kbuf = buf;
+	return 0;
+}
+
+/*
+ * Run a whole flash sequence inside an open session: download, then
+ * optionally manifest and read back, as selected by DFU_FLASH_* flags.
+ */
+static int dfu_flash_image(struct dfu1_device *dfudev, struct dfu_src *src,
+			unsigned int flags)
+{
+	int retv, dfust;
+
+	dfust = dfu_get_state(dfudev->stctrl);
+	if (dfust != dfuIDLE &&
+			!(dfust == dfuDNLOAD_IDLE && dfudev->resume > 0)) {
+		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
+		return -EINVAL;
+	}
+	WRITE_ONCE(dfudev->prog_done, 0);
+	WRITE_ONCE(dfudev->prog_total, (flags & DFU_FLASH_VERIFY) ?
+						2*src->len : src->len);
+	if (dfu_dnload_blocks(dfudev, src, 0) != src->len)
+		return -EIO;
+	if (!(flags & DFU_FLASH_MANIFEST))
+		return 0;
+
+	retv = 0;
+	dfust = dfu_manifest(dfudev);
+	if (dfust < 0) {
+		dev_err(&dfudev->intf->dev, "Manifestation failed: %d\n",
+				dfust);
+		retv = dfust;
+	} else if (dfust == dfuMANIFEST_WAIT_RESET) {
+		if (flags & DFU_FLASH_VERIFY) {
+			dev_err(&dfudev->intf->dev,
+				"Cannot verify, device waits for reset\n");
+			retv = -EIO;
+		}
+	} else if (dfust != dfuIDLE) {
+		dev_err(&dfudev->intf->dev,
+			"Manifestation failed. DFU State: %d\n", dfust);
+		retv = -EIO;
+	} else if (flags & DFU_FLASH_VERIFY) {
+		retv = dfu_verify_blocks(dfudev, src);
+	}
+	return retv;
+}
+
+static int dfu_ioctl_flash(struct dfu1_device *dfudev, void __user *argp)
+{
+	struct dfu_flash flash;
+	struct dfu_src src;
+	int retv, dfust;
+
+	if (copy_from_user(&flash, argp, sizeof(flash)))
+		return -EFAULT;
+	if ((flash.flags & ~DFU_FLASH_FLAGS) ||
+			((flash.flags & DFU_FLASH_VERIFY) &&
+			 !(flash.flags & DFU_FLASH_MANIFEST)))
+		return -EINVAL;
+
+	src.ubuf = NULL;
+	src.kbuf = NULL;
+	src.len = flash.len;
+	if (flash.flags & DFU_FLASH_FD) {
+		retv = dfu_read_image(flash.image, &src);
+		if (retv)
+			return retv;
+	} else {
+		if (src.len == 0 || src.len > DFU_MAX_IMAGE)
+			return -EINVAL;
+		src.ubuf = u64_to_user_ptr(flash.image);
+		if (!access_ok(VERIFY_READ, src.ubuf, src.len))
+			return -EFAULT;
+	}
+
+	retv = dfu_flash_image(dfudev, &src, flash.flags);
+	vfree(src.kbuf);
+	return retv;
+}
+
+/* a kernel copy of the image of an ioctl, for engines that parse it */
+static int dfu_image_kbuf(u64 image, u64 len, unsigned int flags,
+			struct dfu_src *src)
+{
+	src->ubuf = NULL;
+	src->kbuf = NULL;
+	src->len = len;
+	if (flags & DFU_FLASH_FD)
+		return dfu_read_image(image, src);
+
+	if (src->len == 0 || src->len > DFU_MAX_IMAGE)
+		return -EINVAL;
+	src->kbuf = vmalloc(src->len);
+	if (!src->kbuf)
+		return -ENOMEM;
+	if (copy_from_user((void *)src->kbuf, u64_to_user_ptr(image),
+				src->len)) {
+		vfree(src->kbuf);
+		src->kbuf = NULL;
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * Differential flashing on Tiva/Stellaris. The boot loader takes vendor
+ * commands as an 8 byte DNLOAD at block 0, with flash addresses counted
+ * in 1KiB erase blocks.
+ */
+#define DFU_TIVA_BLKSIZE	1024
+#define DFU_TIVA_PROG		0x01	/* following DNLOADs are programmed */
+#define DFU_TIVA_READ		0x02	/* following UPLOADs read the flash */
+#define DFU_TIVA_ERASE		0x04
+#define DFU_TIVA_BIN		0x06	/* UPLOAD without the image header */
+
+struct dfu_tiva_cmd {
+	u8 cmd;
+	u8 arg8;		/* binary flag of DFU_TIVA_BIN */
+	__le16 addr;		/* in DFU_TIVA_BLKSIZE units */
+	__le32 arg32;		/* length in bytes, or blocks for ERASE */
+} __packed;
+
+static inline int dfu_is_stellaris(struct dfu1_device *dfudev)
+{
+	return dfudev->quirk.flags & DFU_QUIRK_TIVA;
+}
+
+/*
+ * Send a vendor command as a DNLOAD at block 0 and wait until the device
+ * has carried it out.
+ */
+static int dfu_cmd_dnload(struct dfu1_device *dfudev, const void *cmd,
+			int len)
+{
+	struct dfu_control *opctrl, *stctrl;
+	int retv;
+
+	opctrl = dfudev->opctrl[0];
+	stctrl = dfudev->stctrl;
+	opctrl->req.bRequestType = 0x21;
+	opctrl->req.bRequest = USB_DFU_DNLOAD;
+	opctrl->req.wValue = 0;
+	opctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
+	opctrl->req.wLength = cpu_to_le16(len);
+	opctrl->pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
+	opctrl->len = len;
+	memcpy(opctrl->datbuf, cmd, len);
+	dfu_uc_invalidate(dfudev, 1);
+	retv = dfu_submit_urb(opctrl, urb_timeout);
+	if (retv == 0)
+		retv = dfu_get_status(stctrl);
+	if (retv == 0)
+		retv = dfu_wait_busy(dfudev, stctrl);
+	if (retv == 0 && stctrl->dfuStatus.bState == dfuERROR)
+		retv = -EIO;
+	if (retv)
+		dev_err(&dfudev->intf->dev,
+			"DFU command %2.2x failed: %d, Status: %d\n",
+			(int)*(const u8 *)cmd, retv,
+			(int)stctrl->dfuStatus.bStatus);
+	return retv;
+}
+
+static int dfu_tiva_cmd(struct dfu1_device *dfudev, u8 cmd, u8 arg8,
+			unsigned int addr, u32 arg32)
+{
+	struct dfu_tiva_cmd tcmd;
+
+	memset(&tcmd, 0, sizeof(tcmd));
+	tcmd.cmd = cmd;
+	tcmd.arg8 = arg8;
+	tcmd.addr = cpu_to_le16(addr);
+	tcmd.arg32 = cpu_to_le32(arg32);
+	return dfu_cmd_dnload(dfudev, &tcmd, sizeof(tcmd));
+}
+
+/* read @nblk flash blocks from block @first into @buf, nothing past it */
+static int dfu_tiva_read(struct dfu1_device *dfudev, unsigned int first,
+			unsigned int nblk, u8 *buf)
+{
+	size_t len = (size_t)nblk * DFU_TIVA_BLKSIZE;
+	loff_t pos = 0;
+	int retv;
+
+	retv = dfu_tiva_cmd(dfudev, DFU_TIVA_BIN, 1, 0, 0);
+	if (retv == 0)
+		retv = dfu_tiva_cmd(dfudev, DFU_TIVA_READ, 0, first, len);
+	if (retv)
+		return retv;
+	if (dfu_upload_blocks(dfudev, NULL, buf, NULL, len, &pos) !=
+			(ssize_t)len)
+		retv = -EIO;
+	if (dfu_get_state(dfudev->stctrl) != dfuIDLE)
+		dfu_abort(dfudev->stctrl);
+	return retv;
+}
+
+/*
+ * Compare the image with the flash it goes to and only erase and program
+ * the runs of blocks that differ. The CRCs of what was programmed are
+ * kept, so that flashing the next build needs no read back; any other
+ * download drops them.
+ */
+static int dfu_flash_diff(struct dfu1_device *dfudev, struct dfu_src *src,
+			unsigned int addr, unsigned int flags,
+			struct dfu_flash_diff *diff)
+{
+	unsigned int first, nblk, i, j, blen;
+	unsigned long *chg;
+	struct dfu_src run;
+	u8 *old;
+	u32 *crcs;
+	size_t off;
+	int retv;
+
+	if (dfu_get_state(dfudev->stctrl) != dfuIDLE)
+		return -EINVAL;
+	first = addr / DFU_TIVA_BLKSIZE;
+	nblk = DIV_ROUND_UP(src->len, DFU_TIVA_BLKSIZE);
+	if (first + nblk > 0x10000)
+		return -EINVAL;
+
+	retv = -ENOMEM;
+	crcs = kmalloc_array(nblk, sizeof(u32), GFP_KERNEL);
+	if (!crcs)
+		goto err_10;
+	chg = kcalloc(BITS_TO_LONGS(nblk), sizeof(long), GFP_KERNEL);
+	if (!chg)
+		goto err_20;
+	old = NULL;
+	for (i = 0; i < nblk; i++) {
+		off = (size_t)i * DFU_TIVA_BLKSIZE;
+		blen = min_t(size_t, src->len - off, DFU_TIVA_BLKSIZE);
+		crcs[i] = crc32(~0, src->kbuf + off, blen);
+	}
+	if (!(flags & DFU_DIFF_NOCACHE) && dfudev->dcrc_n &&
+			first >= dfudev->dcrc_first &&
+			first + nblk <= dfudev->dcrc_first + dfudev->dcrc_n) {
+		j = first - dfudev->dcrc_first;
+		for (i = 0; i < nblk; i++)
+			if (crcs[i] != dfudev->dcrc[j + i])
+				set_bit(i, chg);
+	} else {
+		old = vmalloc((size_t)nblk * DFU_TIVA_BLKSIZE);
+		if (!old)
+			goto err_30;
+		retv = dfu_tiva_read(dfudev, first, nblk, old);
+		if (retv)
+			goto err_40;
+		for (i = 0; i < nblk; i++) {
+			off = (size_t)i * DFU_TIVA_BLKSIZE;
+			blen = min_t(size_t, src->len - off, DFU_TIVA_BLKSIZE);
+			if (memcmp(old + off, src->kbuf + off, blen))
+				set_bit(i, chg);
+		}
+	}
+
+	dfudev->dcrc_n = 0;
+	diff->written = bitmap_weight(chg, nblk);
+	diff->skipped = nblk - diff->written;
+	WRITE_ONCE(dfudev->prog_done, 0);
+	WRITE_ONCE(dfudev->prog_total, src->len);
+	retv = 0;
+	for (i = find_first_bit(chg, nblk); i < nblk;
+			i = find_next_bit(chg, nblk, j)) {
+		j = find_next_zero_bit(chg, nblk, i);
+		off = (size_t)i * DFU_TIVA_BLKSIZE;
+		run.ubuf = NULL;
+		run.kbuf = src->kbuf + off;
+		run.len = min_t(size_t, src->len, (size_t)j * DFU_TIVA_BLKSIZE)
+				- off;
+		retv = dfu_tiva_cmd(dfudev, DFU_TIVA_ERASE, 0, first + i, j - i);
+		if (retv == 0)
+			retv = dfu_tiva_cmd(dfudev, DFU_TIVA_PROG, 0, first + i,
+						run.len);
+		if (retv)
+			break;
+		dfudev->resume = -1;
+		if (dfu_dnload_blocks(dfudev, &run, 0) != run.len)
+			retv = -EIO;
+		dfudev->resume = -1;
+		dfu_abort(dfudev->stctrl);
+		if (retv)
+			break;
+	}
+	spin_lock_irq(&dfudev->stats.lock);
+	dfudev->dsum_len = -1;
+	spin_unlock_irq(&dfudev->stats.lock);
+	if (retv == 0) {
+		WRITE_ONCE(dfudev->prog_done, src->len);
+		swap(dfudev->dcrc, crcs);
+		dfudev->dcrc_first = first;
+		dfudev->dcrc_n = nblk;
+		dev_info(&dfudev->intf->dev,
+			"Programmed %u of %u flash blocks\n", diff->written,
+			nblk);
+	}
+
+err_40:
+	vfree(old);
+err_30:
+	kfree(chg);
+err_20:
+	kfree(crcs);
+err_10:
+	return retv;
+}
+
+static int dfu_ioctl_flash_diff(struct dfu1_device *dfudev,
+			void __user *argp)
+{
+	struct dfu_flash_diff diff;
+	struct dfu_src src;
+	int retv;
+
+	if (copy_from_user(&diff, argp, sizeof(diff)))
+		return -EFAULT;
+	if ((diff.flags & ~DFU_DIFF_FLAGS) ||
+			diff.addr % DFU_TIVA_BLKSIZE)
+		return -EINVAL;
+	if (!dfu_is_stellaris(dfudev))
+		return -EOPNOTSUPP;
+
+	retv = dfu_image_kbuf(diff.image, diff.len, diff.flags, &src);
+	if (retv)
+		return retv;
+	retv = dfu_flash_diff(dfudev, &src, diff.addr, diff.flags, &diff);
+	vfree(src.kbuf);
+	if (retv == 0 && copy_to_user(argp, &diff, sizeof(diff)))
+		retv = -EFAULT;
+	return retv;
+}
+
+/*
+ * DfuSe, ST's DFU 1.1a extensions. Commands go as DNLOAD at block 0, and
+ * block n >= 2 lands at the address pointer plus n - 2 transfer sizes.
+ * The interface string describes the sectors of the memory, e.g.
+ * "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg".
+ */
+#define DFUSE_SETADDR		0x21
+#define DFUSE_ERASE		0x41
+#define DFUSE_MAXSEG		16
+#define DFUSE_MAXSECT		65536
+#define DFUSE_PREFIX		11	/* "DfuSe", bVersion, size, bTargets */
+#define DFUSE_TARGET		274	/* "Target", alt, name, size, elements */
+#define DFUSE_SUFFIX		16
+
+struct dfuse_seg {
+	u32 addr;
+	u32 size;	/* of one sector */
+	u32 count;
+	u32 first;	/* number of its first sector in the layout */
+	u8 attr;	/* 1: readable, 2: erasable, 4: writable */
+};
+
+struct dfuse_elem {
+	u32 addr;
+	u32 size;
+	const u8 *data;
+};
+
+static int dfuse_layout(struct dfu1_device *dfudev, struct dfuse_seg *seg)
+{
+	char *str, *p;
+	int nseg, retv;
+	u32 base, nsect;
+
+	str = kmalloc(256, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+	retv = usb_string(dfudev->usbdev,
+			dfudev->intf->cur_altsetting->desc.iInterface,
+			str, 256);
+	if (retv < 0)
+		goto out;
+	nseg = 0;
+	nsect = 0;
+	p = strchr(str, '/');
+	while (p && *p == '/') {
+		base = simple_strtoul(p + 1, &p, 16);
+		if (*p != '/')
+			break;
+		do {
+			if (nseg == DFUSE_MAXSEG)
+				goto bad;
+			seg[nseg].count = simple_strtoul(p + 1, &p, 10);
+			if (*p != '*' || seg[nseg].count > DFUSE_MAXSECT - nsect)
+				goto bad;
+			seg[nseg].first = nsect;
+			nsect += seg[nseg].count;
+			seg[nseg].size = simple_strtoul(p + 1, &p, 10);
+			if (*p == 'K' || *p == 'M' || *p == ' ') {
+				if (*p == 'K')
+					seg[nseg].size <<= 10;
+				else if (*p == 'M')
+					seg[nseg].size <<= 20;
+				p++;
+			}
+			if (*p < 'a' || *p > 'g' || seg[nseg].size == 0)
+				goto bad;
+			seg[nseg].attr = *p++ - 'a' + 1;
+			seg[nseg].addr = base;
+			base += seg[nseg].count * seg[nseg].size;
+			nseg++;
+		} while (*p == ',');
+	}
+	retv = nseg;
+	if (nseg)
+		goto out;
+bad:
+	dev_err(&dfudev->intf->dev, "Cannot parse DfuSe memory layout: %s\n",
+			str);
+	retv = -EINVAL;
+out:
+	kfree(str);
+	return retv;
+}
+
+/*
+ * The segment holding @addr, with the start of its sector in @sect and
+ * the number of that sector in the layout in @snum
+ */
+static const struct dfuse_seg *dfuse_sector(const struct dfuse_seg *seg,
+			int nseg, u32 addr, u32 *sect, u32 *snum)
+{
+	int i;
+
+	for (i = 0; i < nseg; i++) {
+		if (addr < seg[i].addr || (u64)addr - seg[i].addr >=
+				(u64)seg[i].size * seg[i].count)
+			continue;
+		*sect = addr - (addr - seg[i].addr) % seg[i].size;
+		*snum = seg[i].first + (addr - seg[i].addr) / seg[i].size;
+		return &seg[i];
+	}
+	return NULL;
+}
+
+/*
+ * Collect the elements of the targets for the current alternate setting
+ * into @elem, or just count them if @elem is NULL.
+ */
+static int dfuse_parse(struct dfu1_device *dfudev, const u8 *img,
+			size_t len, struct dfuse_elem *elem)
+{
+	u32 ntgt, nelem, esize, t, i;
+	size_t off, end;
+	int alt, talt, n;
+
+	if (len < DFUSE_PREFIX + DFUSE_SUFFIX || memcmp(img, "DfuSe", 5) ||
+			img[5] != 1)
+		return -EINVAL;
+	end = get_unaligned_le32(img + 6);
+	if (end > len || end < DFUSE_PREFIX)
+		return -EINVAL;
+	ntgt = img[10];
+	alt = dfudev->intf->cur_altsetting->desc.bAlternateSetting;
+	off = DFUSE_PREFIX;
+	n = 0;
+	for (t = 0; t < ntgt; t++) {
+		if (end - off < DFUSE_TARGET || memcmp(img + off, "Target", 6))
+			return -EINVAL;
+		talt = img[off + 6];
+		nelem = get_unaligned_le32(img + off + 270);
+		off += DFUSE_TARGET;
+		for (i = 0; i < nelem; i++) {
+			if (end - off < 8)
+				return -EINVAL;
+			esize = get_unaligned_le32(img + off + 4);
+			if (end - off - 8 < esize)
+				return -EINVAL;
+			if (talt == alt && esize) {
+				if (elem) {
+					elem[n].addr =
+						get_unaligned_le32(img + off);
+					elem[n].size = esize;
+					elem[n].data = img + off + 8;
+				}
+				n++;
+			}
+			off += 8 + esize;
+		}
+		if (talt != alt && elem)
+			dev_warn(&dfudev->intf->dev,
+				"Skipped DfuSe target of alternate setting %d\n",
+				talt);
+	}
+	return n;
+}
+
+static int dfuse_cmd(struct dfu1_device *dfudev, u8 cmd, u32 addr)
+{
+	u8 buf[5];
+
+	buf[0] = cmd;
+	put_unaligned_le32(addr, buf + 1);
+	return dfu_cmd_dnload(dfudev, buf, sizeof(buf));
+}
+
+/*
+ * Flash the elements of a DfuSe image one sector at a time, each through
+ * the pipelined download from block 2 after setting the address pointer,
+ * so gaps between elements are never sent. Sectors are erased all before
+ * the first write, or with DFU_DFUSE_LAZY each just before it is written;
+ * either way each sector only once, whatever the order of the elements.
+ */
+static int dfu_flash_dfuse(struct dfu1_device *dfudev, struct dfu_src *src,
+			unsigned int flags)
+{
+	struct dfuse_seg seg[DFUSE_MAXSEG];
+	const struct dfuse_seg *sg;
+	struct dfuse_elem *elem;
+	struct dfu_src chunk;
+	unsigned long *erased;
+	u32 addr, sect, snum;
+	int nseg, nelem, nerase, i, lazy, pass, retv;
+	size_t off, total;
+
+	if (dfu_get_state(dfudev->stctrl) != dfuIDLE ||
+			src->len < DFUSE_PREFIX + DFUSE_SUFFIX)
+		return -EINVAL;
+	if (!memcmp(src->kbuf + src->len - 8, "UFD", 3) &&
+			crc32(~0, src->kbuf, src->len - 4) !=
+			get_unaligned_le32(src->kbuf + src->len - 4)) {
+		dev_err(&dfudev->intf->dev, "DfuSe image CRC mismatch\n");
+		return -EILSEQ;
+	}
+	nseg = dfuse_layout(dfudev, seg);
+	if (nseg < 0)
+		return nseg;
+	nelem = dfuse_parse(dfudev, src->kbuf, src->len, NULL);
+	if (nelem <= 0) {
+		dev_err(&dfudev->intf->dev, "No DfuSe elements to flash\n");
+		return -EINVAL;
+	}
+	elem = kcalloc(nelem, sizeof(*elem), GFP_KERNEL);
+	if (!elem)
+		return -ENOMEM;
+	erased = kcalloc(BITS_TO_LONGS(seg[nseg - 1].first +
+				seg[nseg - 1].count), sizeof(long), GFP_KERNEL);
+	if (!erased) {
+		kfree(elem);
+		return -ENOMEM;
+	}
+	dfuse_parse(dfudev, src->kbuf, src->len, elem);
+
+	total = 0;
+	for (i = 0; i < nelem; i++)
+		total += elem[i].size;
+	WRITE_ONCE(dfudev->prog_done, 0);
+	WRITE_ONCE(dfudev->prog_total, total);
+	lazy = !!(flags & DFU_DFUSE_LAZY);
+	nerase = 0;
+	retv = 0;
+	/* pass 0 erases up front, pass 1 writes and erases lazily */
+	for (pass = lazy; pass < 2 && retv == 0; pass++) {
+		for (i = 0; i < nelem && retv == 0; i++) {
+			for (off = 0; off < elem[i].size; off += chunk.len) {
+				addr = elem[i].addr + off;
+				sg = dfuse_sector(seg, nseg, addr, &sect,
+							&snum);
+				if (!sg || !(sg->attr & 4)) {
+					dev_err(&dfudev->intf->dev,
+						"Cannot write at %08x\n", addr);
+					retv = -EINVAL;
+					break;
+				}
+				chunk.ubuf = NULL;
+				chunk.kbuf = elem[i].data + off;
+				chunk.len = min_t(size_t, elem[i].size - off,
+						sect + sg->size - addr);
+				if (pass == lazy && (sg->attr & 2) &&
+						!test_bit(snum, erased)) {
+					retv = dfuse_cmd(dfudev, DFUSE_ERASE,
+								sect);
+					if (retv)
+						break;
+					set_bit(snum, erased);
+					nerase++;
+				}
+				if (pass == 0)
+					continue;
+				retv = dfuse_cmd(dfudev, DFUSE_SETADDR, addr);
+				if (retv)
+					break;
+				dfudev->resume = -1;
+				if (dfu_dnload_blocks(dfudev, &chunk,
+						2 * dfudev->xfersize) !=
+						chunk.len) {
+					retv = -EIO;
+					break;
+				}
+			}
+		}
+	}
+	dfudev->resume = -1;
+	if (retv == 0)
+		dev_info(&dfudev->intf->dev,
+			"DfuSe: %d elements, %zu bytes, %d sectors erased\n",
+			nelem, total, nerase);
+
+	if (retv == 0 && (flags & DFU_FLASH_MANIFEST)) {
+		retv = dfuse_cmd(dfudev, DFUSE_SETADDR, elem[0].addr);
+		if (retv == 0) {
+			i = dfu_manifest(dfudev);
+			if (i < 0)
+				retv = i;
+		}
+	} else if (dfu_get_state(dfudev->stctrl) != dfuIDLE) {
+		dfu_abort(dfudev->stctrl);
+	}
+	kfree(erased);
+	kfree(elem);
+	return retv;
+}
+
+static int dfu_ioctl_dfuse(struct dfu1_device *dfudev, void __user *argp)
+{
+	struct dfu_flash flash;
+	struct dfu_src src;
+	int retv;
+
+	if (copy_from_user(&flash, argp, sizeof(flash)))
+		return -EFAULT;
+	if (flash.flags & ~DFU_DFUSE_FLAGS)
+		return -EINVAL;
+	if (!(dfudev->quirk.flags & DFU_QUIRK_DFUSE))
+		return -EOPNOTSUPP;
+
+	retv = dfu_image_kbuf(flash.image, flash.len, flash.flags, &src);
+	if (retv)
+		return retv;
+	retv = dfu_flash_dfuse(dfudev, &src, flash.flags);
+	vfree(src.kbuf);
+	return retv;
+}
+
+/*
+ * Switch to another DFU alternate setting. Whatever the driver knew
+ * about the contents of the old one no longer applies.
+ */
+static int dfu_set_alt(struct dfu1_device *dfudev, unsigned int alt)
+{
+	int i, dfust, retv;
+
+	for (i = 0; i < dfudev->nalts; i++)
+		if (dfudev->alts[i].alt == alt)
+			break;
+	if (i == dfudev->nalts)
+		return -EINVAL;
+	if (alt == dfudev->intf->cur_altsetting->desc.bAlternateSetting)
+		return 0;
+	dfust = dfu_get_state(dfudev->stctrl);
+	if (dfust != dfuIDLE) {
+		dev_err(&dfudev->intf->dev, "Inconsistent State: %d\n", dfust);
+		return -EINVAL;
+	}
+	retv = usb_set_interface(dfudev->usbdev, dfudev->intfnum, alt);
+	if (retv) {
+		dev_err(&dfudev->intf->dev,
+			"Cannot select alternate setting %u: %d\n", alt, retv);
+		return retv;
+	}
+	dfudev->resume = -1;
+	dfudev->dcrc_n = 0;
+	dfudev->utlen = 0;
+	spin_lock_irq(&dfudev->stats.lock);
+	dfudev->dsum_len = -1;
+	spin_unlock_irq(&dfudev->stats.lock);
+	return 0;
+}
+
+static int dfu_ioctl_set_alt(struct dfu1_device *dfudev, __u32 __user *argp)
+{
+	__u32 alt;
+
+	if (get_user(alt, argp))
+		return -EFAULT;
+	return dfu_set_alt(dfudev, alt);
+}
+
+static int dfu_ioctl_progress(struct dfu1_device *dfudev, void __user *argp)
+{
+	struct dfu_progress prog;
+
+	prog.done = READ_ONCE(dfudev->prog_done);
+	prog.total = READ_ONCE(dfudev->prog_total);
+	spin_lock_irq(&dfudev->stats.lock);
+	prog.state = dfudev->stats.state;
+	prog.status = dfudev->stats.status;
+	spin_unlock_irq(&dfudev->stats.lock);
+	if (copy_to_user(argp, &prog, sizeof(prog)))
+		return -EFAULT;
+	return 0;
+}
+
+static int dfu_ioctl_flash_group(struct dfu1_device *self, void __user *argp);
+static int dfu_ioctl_commit(struct dfu1_device *dfudev, void __user *argp);
+static int dfu_mmap(struct file *filp, struct vm_area_struct *vma);
+
+static int dfu_ioctl_eventfd(struct dfu1_device *dfudev, int __user *argp)
+{
+	struct eventfd_ctx *evctx;
+	int fd;
+
+	if (get_user(fd, argp))
+		return -EFAULT;
+	evctx = NULL;
+	if (fd >= 0) {
+		evctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(evctx))
+			return PTR_ERR(evctx);
+	}
+	dfu_set_eventfd(dfudev, evctx);
+	return 0;
+}
+
+/*
+ * Nonblocking I/O goes through a staging buffer and dfu_async_work().
+ * A write is copied in and downloaded behind the caller's back; its
+ * error, if any, is returned by the next read or write. A read starts
+ * uploading into the buffer and returns -EAGAIN, and the data is handed
+ * out by the reads that follow once poll() says POLLIN.
+ */
+static void dfu_async_work(struct work_struct *work)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_src src;
+	loff_t pos;
+	ssize_t numb;
+
+	dfudev = container_of(work, struct dfu1_device, awork);
+	if (dfudev->adir == DFU_ASYNC_DNLOAD) {
+		dfudev->aerr = dfu_dnload_ready(dfudev);
+		if (dfudev->aerr == 0) {
+			src.ubuf = NULL;
+			src.kbuf = dfudev->abuf;
+			src.len = dfudev->alen;
+			if (dfu_dnload_blocks(dfudev, &src, dfudev->apos) !=
+					dfudev->alen)
+				dfudev->aerr = -EIO;
+		}
+	} else {
+		pos = dfudev->apos;
+		numb = dfu_upload_blocks(dfudev, NULL, dfudev->abuf, NULL,
+					dfudev->alen, &pos);
+		if (numb < 0) {
+			dfudev->aerr = numb;
+			numb = 0;
+		}
+		dfudev->alen = numb;
+	}
+	smp_store_release(&dfudev->abusy, 0);
+	wake_up_interruptible(&dfudev->await);
+}
+
+static int dfu_async_buf(struct dfu1_device *dfudev)
+{
+	if (!dfudev->abuf)
+		dfudev->abuf = vmalloc(DFU_ASYNC_BUFLEN);
+	return dfudev->abuf ? 0 : -ENOMEM;
+}
+
+static void dfu_async_start(struct dfu1_device *dfudev, int dir, loff_t pos,
+			size_t len)
+{
+	dfudev->adir = dir;
+	dfudev->apos = pos;
+	dfudev->alen = len;
+	dfudev->aerr = 0;
+	dfudev->abusy = 1;
+	queue_work(dfu_wq, &dfudev->awork);
+}
+
+/* wait for write behind or read ahead, and collect its error */
+static int dfu_async_sync(struct dfu1_device *dfudev)
+{
+	int retv;
+
+	if (wait_event_interruptible(dfudev->await,
+				!smp_load_acquire(&dfudev->abusy)))
+		return -ERESTARTSYS;
+	retv = dfudev->aerr;
+	dfudev->aerr = 0;
+	dfudev->adir = DFU_ASYNC_NONE;
+	return retv;
+}
+
+static inline int dfu_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		(iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Hand out finished read ahead at iocb->ki_pos, or -ENODATA if it does
+ * not cover that position
+ */
+static ssize_t dfu_read_ahead(struct dfu1_device *dfudev, struct kiocb *iocb,
+			struct iov_iter *to)
+{
+	size_t off, len;
+
+	if (dfudev->adir != DFU_ASYNC_UPLOAD)
+		return -ENODATA;
+	if (iocb->ki_pos < dfudev->apos ||
+	    iocb->ki_pos > dfudev->apos + dfudev->alen) {
+		dfudev->adir = DFU_ASYNC_NONE;
+		return -ENODATA;
+	}
+	off = iocb->ki_pos - dfudev->apos;
+	len = min(iov_iter_count(to), dfudev->alen - off);
+	if (copy_to_iter(dfudev->abuf + off, len, to) != len)
+		return -EFAULT;
+	iocb->ki_pos += len;
+	if (off + len == dfudev->alen)
+		dfudev->adir = DFU_ASYNC_NONE;
+	return len;
+}
+
+static ssize_t dfu_read_nowait(struct dfu1_device *dfudev, struct kiocb *iocb,
+			struct iov_iter *to)
+{
+	ssize_t retv;
+	size_t len;
+
+	if (smp_load_acquire(&dfudev->abusy))
+		return -EAGAIN;
+	if (dfudev->aerr || dfudev->adir == DFU_ASYNC_DNLOAD) {
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+	}
+	retv = dfu_read_ahead(dfudev, iocb, to);
+	if (retv != -ENODATA)
+		return retv;
+	retv = dfu_async_buf(dfudev);
+	if (retv)
+		return retv;
+	len = min_t(size_t, iov_iter_count(to), DFU_ASYNC_BUFLEN);
+	dfu_async_start(dfudev, DFU_ASYNC_UPLOAD, iocb->ki_pos, len);
+	return -EAGAIN;
+}
+
+static ssize_t dfu_write_nowait(struct dfu1_device *dfudev,
+			struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t len;
+	int retv;
+
+	if (smp_load_acquire(&dfudev->abusy))
+		return -EAGAIN;
+	retv = dfu_async_sync(dfudev);
+	if (retv)
+		return retv;
+	retv = dfu_async_buf(dfudev);
+	if (retv)
+		return retv;
+	len = min_t(size_t, iov_iter_count(from), DFU_ASYNC_BUFLEN);
+	if (copy_from_iter(dfudev->abuf, len, from) != len)
+		return -EFAULT;
+	dfu_async_start(dfudev, DFU_ASYNC_DNLOAD, iocb->ki_pos, len);
+	if (iocb->ki_pos != 0 || len > 32)
+		iocb->ki_pos += len;
+	return len;
+}
+
+static ssize_t dfu_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_upcache *uc;
+	struct iovec iov;
+	ssize_t retv, numb;
+	size_t len;
+
+	dfudev = iocb->ki_filp->private_data;
+	uc = dfu_uc_get(dfudev);
+	if (!uc && dfu_nowait(iocb))
+		return dfu_read_nowait(dfudev, iocb, to);
+	if (!uc) {
+		/* the blocking retry of an IOCB_NOWAIT read finds its data */
+		if (wait_event_interruptible(dfudev->await,
+					!smp_load_acquire(&dfudev->abusy)))
+			return -ERESTARTSYS;
+		if (!dfudev->aerr) {
+			retv = dfu_read_ahead(dfudev, iocb, to);
+			if (retv != -ENODATA)
+				return retv;
+		}
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		if (iocb->ki_pos == 0)
+			uc = dfu_uc_load(dfudev);
+	}
+	if (uc) {
+		retv = dfu_uc_read(uc, iocb, to);
+		dfu_uc_put(uc);
+		return retv;
+	}
+
+	numb = 0;
+	while (iov_iter_count(to)) {
+		if (iter_is_iovec(to)) {
+			iov = iov_iter_iovec(to);
+			retv = dfu_upload_blocks(dfudev, iov.iov_base, NULL,
+						NULL, iov.iov_len,
+						&iocb->ki_pos);
+			len = iov.iov_len;
+			if (retv > 0)
+				iov_iter_advance(to, retv);
+		} else {
+			/* blocks go from the transfer buffer straight to @to */
+			len = iov_iter_count(to);
+			retv = dfu_upload_blocks(dfudev, NULL, NULL, to, len,
+						&iocb->ki_pos);
+		}
+		if (retv <= 0)
+			break;
+		numb += retv;
+		if (retv < len)
+			break;
+	}
+	return numb ? numb : retv;
+}
+
+static ssize_t dfu_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_src src;
+	struct iovec iov;
+	ssize_t retv, numb;
+	size_t len;
+
+	dfudev = iocb->ki_filp->private_data;
+	if (dfu_nowait(iocb))
+		return dfu_write_nowait(dfudev, iocb, from);
+	retv = dfu_async_sync(dfudev);
+	if (retv)
+		return retv;
+
+	numb = 0;
+	while (iov_iter_count(from)) {
+		if (iter_is_iovec(from)) {
+			iov = iov_iter_iovec(from);
+			retv = dfu_dnload(iocb->ki_filp, iov.iov_base,
+					iov.iov_len, &iocb->ki_pos);
+			len = iov.iov_len;
+			if (retv > 0)
+				iov_iter_advance(from, retv);
+		} else {
+			retv = dfu_dnload_ready(dfudev);
+			if (retv == 0)
+				retv = dfu_async_buf(dfudev);
+			if (retv)
+				break;
+			len = min_t(size_t, iov_iter_count(from),
+					DFU_ASYNC_BUFLEN);
+			if (copy_from_iter(dfudev->abuf, len, from) != len) {
+				retv = -EFAULT;
+				break;
+			}
+			src.ubuf = NULL;
+			src.kbuf = dfudev->abuf;
+			src.len = len;
+			retv = dfu_dnload_blocks(dfudev, &src, iocb->ki_pos);
+			if (iocb->ki_pos != 0 || retv > 32)
+				iocb->ki_pos += retv;
+		}
+		if (retv <= 0)
+			break;
+		numb += retv;
+		if (retv < len)
+			break;
+	}
+	return numb ? numb : retv;
+}
+
+static unsigned int dfu_poll(struct file *filp, poll_table *wait)
+{
+	struct dfu1_device *dfudev;
+	unsigned int mask;
+
+	dfudev = filp->private_data;
+	poll_wait(filp, &dfudev->await, wait);
+	if (smp_load_acquire(&dfudev->abusy))
+		return 0;
+	mask = POLLOUT | POLLWRNORM;
+	if (dfudev->adir == DFU_ASYNC_UPLOAD)
+		mask |= POLLIN | POLLRDNORM;
+	if (dfudev->aerr)
+		mask |= POLLERR;
+	return mask;
+}
+
+static long dfu_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct dfu1_device *dfudev;
+	int retv;
+
+	dfudev = filp->private_data;
+	switch (cmd) {
+	case DFU_IOC_FLASH:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_flash(dfudev, (void __user *)arg);
+	case DFU_IOC_PROGRESS:
+		return dfu_ioctl_progress(dfudev, (void __user *)arg);
+	case DFU_IOC_FLASH_GROUP:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_flash_group(dfudev, (void __user *)arg);
+	case DFU_IOC_EVENTFD:
+		return dfu_ioctl_eventfd(dfudev, (int __user *)arg);
+	case DFU_IOC_FLASH_DIFF:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_flash_diff(dfudev, (void __user *)arg);
+	case DFU_IOC_VERIFY:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_verify(dfudev, (void __user *)arg);
+	case DFU_IOC_DFUSE:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_dfuse(dfudev, (void __user *)arg);
+	case DFU_IOC_SET_ALT:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_set_alt(dfudev, (__u32 __user *)arg);
+	case DFU_IOC_COMMIT:
+		retv = dfu_async_sync(dfudev);
+		if (retv)
+			return retv;
+		return dfu_ioctl_commit(dfudev, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* only a cached upload can be seeked in */
+static loff_t dfu_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct dfu_upcache *uc;
+	loff_t retv;
+
+	uc = dfu_uc_get(filp->private_data);
+	if (!uc)
+		return -ESPIPE;
+	retv = fixed_size_llseek(filp, offset, whence, uc->len);
+	dfu_uc_put(uc);
+	return retv;
+}
+
+static const struct file_operations dfu_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dfu_open,
+	.release	= dfu_release,
+	.llseek		= dfu_llseek,
+	.read_iter	= dfu_read_iter,
+	.write_iter	= dfu_write_iter,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.poll		= dfu_poll,
+	.mmap		= dfu_mmap,
+	.unlocked_ioctl	= dfu_ioctl
+};
+
+/*
+ * Images loaded through request_firmware() are shared by all devices
+ * flashing the same file at the same time. The image is on the list
+ * while it loads, and the devices that find it there wait for loaded;
+ * dfu_fwlock is not held across the load. A flash group image has no
+ * name and is never on the list. A view is a part of another image, the
+ * staging area, and holds a reference on it.
+ */
+struct dfu_fwimage {
+	struct kref ref;
+	struct list_head list;
+	const struct firmware *fw;
+	struct dfu_fwimage *parent;	/* of a view */
+	struct completion loaded;	/* request_firmware() is done */
+	int err;			/* of request_firmware() */
+	const u8 *data;
+	size_t size;
+	char name[];
+};
+
+/* devices of one DFU_IOC_FLASH_GROUP call */
+struct dfu_fwgroup {
+	atomic_t pending;
+	struct completion done;
+	int *results;
+};
+
+static LIST_HEAD(dfu_fwlist);
+static DEFINE_MUTEX(dfu_fwlock);
+
+static void dfu_fw_release(struct kref *ref)
+{
+	struct dfu_fwimage *img;
+
+	img = container_of(ref, struct dfu_fwimage, ref);
+	list_del(&img->list);
+	mutex_unlock(&dfu_fwlock);
+	if (img->parent)
+		kref_put_mutex(&img->parent->ref, dfu_fw_release,
+				&dfu_fwlock);
+	else if (img->fw)
+		release_firmware(img->fw);
+	else
+		vfree(img->data);
+	kfree(img);
+}
+
+static inline void dfu_fw_put(struct dfu_fwimage *img)
+{
+	kref_put_mutex(&img->ref, dfu_fw_release, &dfu_fwlock);
+}
+
+static struct dfu_fwimage *dfu_fw_get(const char *name, struct device *dev)
+{
+	struct dfu_fwimage *img;
+	int retv;
+
+	mutex_lock(&dfu_fwlock);
+	list_for_each_entry(img, &dfu_fwlist, list) {
+		if (strcmp(img->name, name) == 0) {
+			kref_get(&img->ref);
+			mutex_unlock(&dfu_fwlock);
+			goto exit_10;
+		}
+	}
+	img = kmalloc(sizeof(struct dfu_fwimage) + strlen(name) + 1,
+			GFP_KERNEL);
+	if (!img) {
+		mutex_unlock(&dfu_fwlock);
+		return ERR_PTR(-ENOMEM);
+	}
+	img->fw = NULL;
+	img->parent = NULL;
+	init_completion(&img->loaded);
+	img->err = 0;
+	img->data = NULL;
+	img->size = 0;
+	strcpy(img->name, name);
+	kref_init(&img->ref);
+	list_add(&img->list, &dfu_fwlist);
+	mutex_unlock(&dfu_fwlock);
+
+	retv = request_firmware(&img->fw, name, dev);
+	if (retv) {
+		/* the next dfu_fw_get() of the name tries again */
+		mutex_lock(&dfu_fwlock);
+		list_del_init(&img->list);
+		mutex_unlock(&dfu_fwlock);
+		img->fw = NULL;
+		img->err = retv;
+	} else {
+		img->data = img->fw->data;
+		img->size = img->fw->size;
+	}
+	complete_all(&img->loaded);
+
+exit_10:
+	wait_for_completion(&img->loaded);
+	if (img->err) {
+		retv = img->err;
+		dfu_fw_put(img);
+		return ERR_PTR(retv);
+	}
+	return img;
+}
+
+/* wrap a vmalloc'ed image, which the dfu_fwimage then owns */
+static struct dfu_fwimage *dfu_fw_wrap(const u8 *data, size_t size)
+{
+	struct dfu_fwimage *img;
+
+	img = kmalloc(sizeof(struct dfu_fwimage) + 1, GFP_KERNEL);
+	if (!img)
+		return NULL;
+	img->fw = NULL;
+	img->parent = NULL;
+	img->data = data;
+	img->size = size;
+	img->name[0] = 0;
+	kref_init(&img->ref);
+	INIT_LIST_HEAD(&img->list);
+	return img;
+}
+
+/*
+ * The staging area of a session is what mmap() on /dev/dfu? maps. User
+ * space fills it, and DFU_IOC_COMMIT or a DFU_FLASH_STAGED flash group
+ * downloads from it with no other copy. Every mapping holds a reference,
+ * so a larger mmap() can replace the area while the old one is mapped,
+ * and the area outlives the session while it is mapped or flashed.
+ */
+static void dfu_stage_vm_open(struct vm_area_struct *vma)
+{
+	struct dfu_fwimage *img = vma->vm_private_data;
+
+	kref_get(&img->ref);
+}
+
+static void dfu_stage_vm_close(struct vm_area_struct *vma)
+{
+	dfu_fw_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct dfu_stage_vmops = {
+	.open	= dfu_stage_vm_open,
+	.close	= dfu_stage_vm_close,
+};
+
+static int dfu_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_fwimage *img, *old;
+	unsigned long size;
+	void *data;
+	int retv;
+
+	dfudev = filp->private_data;
+	size = vma->vm_end - vma->vm_start;
+	if (vma->vm_pgoff || size > DFU_MAX_IMAGE ||
+			!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&dfudev->stagelock);
+	img = dfudev->stage;
+	if (!img || img->size < size) {
+		retv = -ENOMEM;
+		data = vmalloc_user(size);
+		if (!data)
+			goto exit_10;
+		img = dfu_fw_wrap(data, size);
+		if (!img) {
+			vfree(data);
+			goto exit_10;
+		}
+		old = dfudev->stage;
+		dfudev->stage = img;
+		if (old)
+			dfu_fw_put(old);
+	}
+	retv = remap_vmalloc_range(vma, (void *)img->data, 0);
+	if (retv == 0) {
+		kref_get(&img->ref);
+		vma->vm_private_data = img;
+		vma->vm_ops = &dfu_stage_vmops;
+	}
+
+exit_10:
+	mutex_unlock(&dfudev->stagelock);
+	return retv;
+}
+
+/* a view of @len bytes at @off of the staging area */
+static struct dfu_fwimage *dfu_stage_view(struct dfu1_device *dfudev,
+			u64 off, u64 len)
+{
+	struct dfu_fwimage *img, *view;
+
+	mutex_lock(&dfudev->stagelock);
+	img = dfudev->stage;
+	if (!img || len == 0 || off > img->size || len > img->size - off) {
+		view = ERR_PTR(-EINVAL);
+		goto exit_10;
+	}
+	view = dfu_fw_wrap(img->data + off, len);
+	if (!view) {
+		view = ERR_PTR(-ENOMEM);
+		goto exit_10;
+	}
+	kref_get(&img->ref);
+	view->parent = img;
+
+exit_10:
+	mutex_unlock(&dfudev->stagelock);
+	return view;
+}
+
+static void dfu_stage_drop(struct dfu1_device *dfudev)
+{
+	struct dfu_fwimage *img;
+
+	mutex_lock(&dfudev->stagelock);
+	img = dfudev->stage;
+	dfudev->stage = NULL;
+	mutex_unlock(&dfudev->stagelock);
+	if (img)
+		dfu_fw_put(img);
+}
+
+static int dfu_ioctl_commit(struct dfu1_device *dfudev, void __user *argp)
+{
+	struct dfu_flash flash;
+	struct dfu_fwimage *img;
+	struct dfu_src src;
+	int retv;
+
+	if (copy_from_user(&flash, argp, sizeof(flash)))
+		return -EFAULT;
+	if ((flash.flags & ~DFU_COMMIT_FLAGS) ||
+			((flash.flags & DFU_FLASH_VERIFY) &&
+			 !(flash.flags & DFU_FLASH_MANIFEST)))
+		return -EINVAL;
+
+	img = dfu_stage_view(dfudev, flash.image, flash.len);
+	if (IS_ERR(img))
+		return PTR_ERR(img);
+	src.ubuf = NULL;
+	src.kbuf = img->data;
+	src.len = img->size;
+	retv = dfu_flash_image(dfudev, &src, flash.flags);
+	dfu_fw_put(img);
+	return retv;
+}
+
+static int dfu_queue_flash(struct dfu1_device *dfudev, struct dfu_fwimage *img,
+			unsigned int flags, struct dfu_fwgroup *grp, int slot)
+{
+	int last;
+
+	last = READ_ONCE(dfudev->fwresult);
+	if (last == -EINPROGRESS ||
+	    cmpxchg(&dfudev->fwresult, last, -EINPROGRESS) != last)
+		return -EBUSY;
+	kref_get(&img->ref);
+	dfudev->fwimg = img;
+	dfudev->fwflags = flags;
+	dfudev->fwgroup = grp;
+	dfudev->fwslot = slot;
+	queue_work(dfu_wq, &dfudev->fwork);
+	return 0;
+}
+
+static void dfu_flash_done(struct dfu1_device *dfudev, int retv)
+{
+	struct dfu_fwgroup *grp;
+
+	grp = dfudev->fwgroup;
+	dfu_fw_put(dfudev->fwimg);
+	dfudev->fwimg = NULL;
+	dfudev->fwgroup = NULL;
+	WRITE_ONCE(dfudev->fwresult, retv);
+	if (grp) {
+		grp->results[dfudev->fwslot] = retv;
+		if (atomic_dec_and_test(&grp->pending))
+			complete(&grp->done);
+	}
+}
+
+static void dfu_flash_work(struct work_struct *work)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_fwimage *img;
+	struct dfu_src src;
+	int retv;
+
+	dfudev = container_of(work, struct dfu1_device, fwork);
+	img = dfudev->fwimg;
+	cancel_delayed_work_sync(&dfudev->rwork);
+	flush_work(&dfudev->mwork);
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY)) {
+		dev_err(&dfudev->intf->dev, "Cannot flash, device busy\n");
+		dfu_flash_done(dfudev, -EBUSY);
+		return;
+	}
+	retv = dfu_session_start(dfudev);
+	if (retv == 0) {
+		src.ubuf = NULL;
+		src.kbuf = img->data;
+		src.len = img->size;
+		retv = dfu_flash_image(dfudev, &src, dfudev->fwflags);
+		dfu_session_end(dfudev);
+	}
+	dfu_unclaim(dfudev);
+	if (retv == 0)
+		dev_info(&dfudev->intf->dev, "Flashed %s, %zu bytes\n",
+				img->name, img->size);
+	else
+		dev_err(&dfudev->intf->dev, "Flashing %s failed: %d\n",
+				img->name, retv);
+	dfu_flash_done(dfudev, retv);
+}
+
+/*
+ * Devices are found by minor through dfu_idr, and by USB port path
+ * through dfu_porttab. A minor is reserved with a NULL entry at probe
+ * and is filled in once /dev/dfu? is up.
+ */
+static DEFINE_MUTEX(dfu_devlock);	/* protects dfu_idr and dfu_porttab */
+static DEFINE_IDR(dfu_idr);
+static DEFINE_HASHTABLE(dfu_porttab, 6);
+static DECLARE_WAIT_QUEUE_HEAD(dfu_probewq);
+static atomic_t dfu_probegen = ATOMIC_INIT(0);	/* bumped by each probe */
+
+static inline u32 dfu_porthash(const char *portpath)
+{
+	return full_name_hash(NULL, portpath, strlen(portpath));
+}
+
+/* the caller holds dfu_devlock */
+static struct dfu1_device *dfu_find_port(const char *portpath)
+{
+	struct dfu1_device *dfudev;
+
+	hash_for_each_possible(dfu_porttab, dfudev, pnode,
+				dfu_porthash(portpath))
+		if (strcmp(dev_name(&dfudev->usbdev->dev), portpath) == 0)
+			return dfudev;
+	return NULL;
+}
+
+/*
+ * Wait for the DFU mode device at USB port path @portpath, as given by
+ * dev_name() of its usb_device, to be probed, for at most @tmout
+ * milliseconds. dfusb0 calls this after detaching the runtime device;
+ * @start is when it did, and the switch time is kept in the new device.
+ * Returns the minor of /dev/dfu?, or an error.
+ */
+int dfu1_wait_device(const char *portpath, ktime_t start, int tmout)
+{
+	struct dfu1_device *dfudev;
+	unsigned long deadline;
+	long left;
+	int gen, minor;
+
+	deadline = jiffies + msecs_to_jiffies(tmout);
+	for (;;) {
+		gen = atomic_read(&dfu_probegen);
+		minor = -ETIMEDOUT;
+		mutex_lock(&dfu_devlock);
+		dfudev = dfu_find_port(portpath);
+		if (dfudev) {
+			dfudev->switch_us = ktime_us_delta(dfudev->probed,
+								start);
+			dev_info(&dfudev->intf->dev,
+				"Switched to DFU mode in %lld us\n",
+				dfudev->switch_us);
+			minor = MINOR(dfudev->devno);
+		}
+		mutex_unlock(&dfu_devlock);
+		if (minor >= 0)
+			return minor;
+		left = (long)(deadline - jiffies);
+		if (left <= 0)
+			return -ETIMEDOUT;
+		left = wait_event_interruptible_timeout(dfu_probewq,
+				atomic_read(&dfu_probegen) != gen, left);
+		if (left < 0)
+			return left;
+	}
+}
+EXPORT_SYMBOL_GPL(dfu1_wait_device);
+
+/*
+ * Flash one image to a set of devices, each one on its own work item of
+ * the unbound work queue. The device the ioctl is issued on, if it is in
+ * the set, is flashed in the caller's context within its open session.
+ */
+static int dfu_ioctl_flash_group(struct dfu1_device *self, void __user *argp)
+{
+	struct dfu_flash_group fgrp;
+	struct dfu1_device *dfudev;
+	struct dfu_fwimage *img;
+	struct dfu_fwgroup grp;
+	struct dfu_src src;
+	u32 *minors;
+	int i, retv, selfslot;
+
+	if (copy_from_user(&fgrp, argp, sizeof(fgrp)))
+		return -EFAULT;
+	if ((fgrp.flags & ~(DFU_FLASH_FLAGS | DFU_FLASH_STAGED)) ||
+			((fgrp.flags & DFU_FLASH_FD) &&
+			 (fgrp.flags & DFU_FLASH_STAGED)) ||
+			((fgrp.flags & DFU_FLASH_VERIFY) &&
+			 !(fgrp.flags & DFU_FLASH_MANIFEST)) ||
+			fgrp.ndevs == 0 || fgrp.ndevs > max_dfus)
+		return -EINVAL;
+
+	src.ubuf = NULL;
+	src.kbuf = NULL;
+	src.len = fgrp.len;
+	if (fgrp.flags & DFU_FLASH_STAGED) {
+		img = dfu_stage_view(self, fgrp.image, fgrp.len);
+		if (IS_ERR(img))
+			return PTR_ERR(img);
+		src.kbuf = img->data;
+	} else {
+		if (fgrp.flags & DFU_FLASH_FD) {
+			retv = dfu_read_image(fgrp.image, &src);
+			if (retv)
+				return retv;
+		} else {
+			if (src.len == 0 || src.len > DFU_MAX_IMAGE)
+				return -EINVAL;
+			src.kbuf = vmalloc(src.len);
+			if (!src.kbuf)
+				return -ENOMEM;
+			if (copy_from_user((void *)src.kbuf,
+					u64_to_user_ptr(fgrp.image),
+					src.len)) {
+				vfree(src.kbuf);
+				return -EFAULT;
+			}
+		}
+		img = dfu_fw_wrap(src.kbuf, src.len);
+		if (!img) {
+			vfree(src.kbuf);
+			return -ENOMEM;
+		}
 	}
 
-	fpos = *f_pos;
-	blknum = fpos / BLKSIZE;
-	lenrem = count;
-	numb = 0;
-	do {
-		opctrl->len = dfudev->xfersize > lenrem ? lenrem :
-							dfudev->xfersize;
-		if (copy_from_user(dfudev->datbuf, buff+numb, opctrl->len))
-			break;
-		opctrl->req.wValue = cpu_to_le16(blknum);
-		opctrl->req.wLength = cpu_to_le16(opctrl->len);
-		dma_sync_single_for_device(ctrler, dmabuf, opctrl->len,
-						DMA_TO_DEVICE);
-		if (dfu_submit_urb(opctrl, urb_timeout) ||
-				dfu_get_status(stctrl))
-			break;
-		len = READ_ONCE(opctrl->nxfer);
-		if (len == 0)
-			break;
-		numb += len;
-		lenrem -= len;
-		fpos += len;
-		blknum = fpos / BLKSIZE;
-		while (stctrl->dfuStatus.bState == dfuDNLOAD_BUSY) {
-			tmout = stctrl->dfuStatus.wmsec[0] |
-					(stctrl->dfuStatus.wmsec[1] << 8) |
-					(stctrl->dfuStatus.wmsec[2] << 16);
-			msleep(tmout);
-			if (dfu_get_status(stctrl))
-				break;
+	retv = -ENOMEM;
+	minors = kmalloc_array(fgrp.ndevs, sizeof(u32), GFP_KERNEL);
+	grp.results = kmalloc_array(fgrp.ndevs, sizeof(int), GFP_KERNEL);
+	if (!minors || !grp.results)
+		goto exit_10;
+	retv = -EFAULT;
+	if (copy_from_user(minors, u64_to_user_ptr(fgrp.minors),
+				fgrp.ndevs * sizeof(u32)))
+		goto exit_10;
+
+	fgrp.flags &= ~(DFU_FLASH_FD | DFU_FLASH_STAGED);
+	init_completion(&grp.done);
+	atomic_set(&grp.pending, fgrp.ndevs + 1);
+	selfslot = -1;
+	mutex_lock(&dfu_devlock);
+	for (i = 0; i < fgrp.ndevs; i++) {
+		dfudev = idr_find(&dfu_idr, minors[i]);
+		if (dfudev == self && selfslot == -1) {
+			selfslot = i;
+			continue;
 		}
-		if (stctrl->dfuStatus.bState != dfuDNLOAD_IDLE &&
-		    stctrl->dfuStatus.bState != dfuIDLE) {
-			dev_err(&dfudev->intf->dev,
-				"Downloading failed. DFU State: %d\n", dfust);
-			break;
+		retv = dfudev ? dfu_queue_flash(dfudev, img, fgrp.flags,
+						&grp, i) : -ENODEV;
+		if (retv) {
+			grp.results[i] = retv;
+			atomic_dec(&grp.pending);
 		}
-	} while (lenrem > 0);
-	if (*f_pos != 0 || numb > 32)
-		*f_pos += numb;
+	}
+	mutex_unlock(&dfu_devlock);
 
-	if (dma)
-		dma_unmap_single(ctrler, dmabuf, dfudev->xfersize,
-				DMA_FROM_DEVICE);
+	if (selfslot != -1) {
+		grp.results[selfslot] = dfu_flash_image(self, &src,
+							fgrp.flags);
+		atomic_dec(&grp.pending);
+	}
+	if (!atomic_dec_and_test(&grp.pending))
+		wait_for_completion(&grp.done);
 
-	return numb;
+	retv = 0;
+	if (copy_to_user(u64_to_user_ptr(fgrp.results), grp.results,
+				fgrp.ndevs * sizeof(int)))
+		retv = -EFAULT;
+
+exit_10:
+	kfree(grp.results);
+	kfree(minors);
+	dfu_fw_put(img);
+	return retv;
 }
 
-static const struct file_operations dfu_fops = {
-	.owner		= THIS_MODULE,
-	.open		= dfu_open,
-	.release	= dfu_release,
-	.read		= dfu_upload,
-	.write		= dfu_dnload
-};
+static ssize_t dfu_flashfw_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%d\n", READ_ONCE(dfudev->fwresult));
+}
+
+static ssize_t dfu_flashfw_store(struct device *dev,
+			struct device_attribute *attr, const char *buf,
+			size_t count)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_fwimage *img;
+	char *name;
+	int retv;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	name = kstrndup(buf, count, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	img = dfu_fw_get(strim(name), &dfudev->intf->dev);
+	kfree(name);
+	if (IS_ERR(img))
+		return PTR_ERR(img);
+
+	retv = dfu_queue_flash(dfudev, img, DFU_FLASH_MANIFEST, NULL, 0);
+	dfu_fw_put(img);
+	return retv ? retv : count;
+}
 
 static ssize_t dfu_sndcmd(struct device *dev, struct device_attribute *attr,
 			const char *buf, size_t count)
@@ -402,33 +3188,25 @@ static ssize_t dfu_sndcmd(struct device *dev, struct device_attribute *attr,
 	if (count < 1 || count > 32)
 		return count;
 
-	dfudev = container_of(attr, struct dfu1_device, tachattr);
-	if (!mutex_trylock(&dfudev->lock)) {
-		dev_err(&dfudev->intf->dev,
-				"Cannot send command, device busy\n");
-		return count;
-	}
-	ctrl = kmalloc(sizeof(struct dfu_control) + count, GFP_KERNEL);
-	if (!ctrl)
-		return -ENOMEM;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
-		return -ENOMEM;
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY))
+		return -EBUSY;
+	ctrl = dfu_ctrl_get(dfudev);
+	if (!ctrl) {
+		dfu_unclaim(dfudev);
+		return -ERESTARTSYS;
 	}
-
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
 	ctrl->req.bRequestType = 0x21;
 	ctrl->req.bRequest = USB_DFU_DNLOAD;
 	ctrl->req.wValue = 0;
 	ctrl->req.wIndex = cpu_to_le16(dfudev->intfnum);
 	ctrl->req.wLength = cpu_to_le16(count);
 	ctrl->pipe = usb_sndctrlpipe(dfudev->usbdev, 0);
-	ctrl->datbuf = ctrl + 1;
+	ctrl->datbuf = ctrl->cmd;
 	memcpy(ctrl->datbuf, buf, count);
 	ctrl->len = count;
+	dfudev->dcrc_n = 0;
+	dfu_uc_invalidate(dfudev, 1);
 	if (dfu_submit_urb(ctrl, urb_timeout) ||
 			dfu_get_status(ctrl))
 		dev_err(&dfudev->intf->dev,
@@ -440,9 +3218,8 @@ static ssize_t dfu_sndcmd(struct device *dev, struct device_attribute *attr,
 				"DFU commmand status: %d, State: %d\n",
 				(int)ctrl->dfuStatus.bStatus,
 				(int)ctrl->dfuStatus.bState);
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
-	mutex_unlock(&dfudev->lock);
+	dfu_ctrl_put(dfudev, ctrl);
+	dfu_unclaim(dfudev);
 	return count;
 }
 
@@ -451,7 +3228,7 @@ static ssize_t dfu_attr_show(struct device *dev, struct device_attribute *attr,
 {
 	struct dfu1_device *dfudev;
 
-	dfudev = container_of(attr, struct dfu1_device, attrattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	return sprintf(buf, "Download:%d Upload:%d Manifest:%d Detach:%d\n",
 		dfudev->download, dfudev->upload, dfudev->manifest,
 		dfudev->detach);
@@ -462,7 +3239,7 @@ static ssize_t dfu_timeout_show(struct device *dev,
 {
 	struct dfu1_device *dfudev;
 
-	dfudev = container_of(attr, struct dfu1_device, tmoutattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	return sprintf(buf, "%d\n", dfudev->dettmout);
 }
 
@@ -471,10 +3248,233 @@ static ssize_t dfu_xfersize_show(struct device *dev,
 {
 	struct dfu1_device *dfudev;
 
-	dfudev = container_of(attr, struct dfu1_device, xsizeattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	return sprintf(buf, "%d\n", dfudev->xfersize);
 }
 
+/*
+ * Blocks are numbered in units of the transfer size, so it can only
+ * change between sessions.
+ */
+static ssize_t dfu_xfersize_store(struct device *dev,
+			struct device_attribute *attr, const char *buf,
+			size_t count)
+{
+	struct dfu1_device *dfudev;
+	unsigned int xfersize;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	if (kstrtouint(buf, 0, &xfersize))
+		return -EINVAL;
+	/*
+	 * Only powers of two divide the flash block and the async buffer,
+	 * besides the device's own wTransferSize.
+	 */
+	if (xfersize == 0)
+		xfersize = dfudev->maxxfer;
+	if (xfersize > dfudev->maxxfer || (xfersize != dfudev->maxxfer &&
+			(xfersize < 8 || !is_power_of_2(xfersize))))
+		return -EINVAL;
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY))
+		return -EBUSY;
+	dfudev->xfersize = xfersize;
+	dfu_unclaim(dfudev);
+	return count;
+}
+
+static ssize_t dfu_alt_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%d\n",
+		(int)dfudev->intf->cur_altsetting->desc.bAlternateSetting);
+}
+
+static ssize_t dfu_alt_store(struct device *dev,
+			struct device_attribute *attr, const char *buf,
+			size_t count)
+{
+	struct dfu1_device *dfudev;
+	unsigned int alt;
+	int retv;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	if (kstrtouint(buf, 0, &alt))
+		return -EINVAL;
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY))
+		return -EBUSY;
+	retv = dfu_set_alt(dfudev, alt);
+	dfu_unclaim(dfudev);
+	return retv ? retv : count;
+}
+
+/* the cached name of @alt, fetched from the device the first time */
+static const char *dfu_alt_name(struct dfu1_device *dfudev,
+			struct dfu_alt *alt)
+{
+	char *name;
+	int len;
+
+	if (alt->name || !alt->istr)
+		return alt->name ? alt->name : "";
+	name = kmalloc(256, GFP_KERNEL);
+	if (!name)
+		return "";
+	len = usb_string(dfudev->usbdev, alt->istr, name, 256);
+	if (len <= 0) {
+		kfree(name);
+		return "";
+	}
+	if (cmpxchg(&alt->name, NULL, name))
+		kfree(name);
+	return alt->name;
+}
+
+static ssize_t dfu_alts_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_alt *alt;
+	int i, num;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	num = 0;
+	for (i = 0; i < dfudev->nalts; i++) {
+		alt = &dfudev->alts[i];
+		num += scnprintf(buf + num, PAGE_SIZE - num, "%d %s\n",
+				alt->alt, dfu_alt_name(dfudev, alt));
+	}
+	return num;
+}
+
+static ssize_t dfu_fastup_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%d\n", dfudev->fastup);
+}
+
+static ssize_t dfu_fastup_store(struct device *dev,
+			struct device_attribute *attr, const char *buf,
+			size_t count)
+{
+	struct dfu1_device *dfudev;
+	bool fastup;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	if (kstrtobool(buf, &fastup))
+		return -EINVAL;
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY))
+		return -EBUSY;
+	dfudev->fastup = fastup;
+	dfu_unclaim(dfudev);
+	return count;
+}
+
+static ssize_t dfu_switch_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%lld\n", READ_ONCE(dfudev->switch_us));
+}
+
+static ssize_t dfu_resume_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%lld\n", READ_ONCE(dfudev->resume));
+}
+
+static ssize_t dfu_digest_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+	loff_t len;
+	u32 crc;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	spin_lock_irq(&dfudev->stats.lock);
+	len = dfudev->dsum_len;
+	crc = ~dfudev->dsum;
+	spin_unlock_irq(&dfudev->stats.lock);
+	if (len <= 0)
+		return sprintf(buf, "none\n");
+	return sprintf(buf, "%08x %lld\n", crc, len);
+}
+
+/* fill the upload cache while no session is open */
+static void dfu_prefetch_work(struct work_struct *work)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_upcache *uc;
+
+	dfudev = container_of(work, struct dfu1_device, pwork);
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY)) {
+		dev_info(&dfudev->intf->dev, "Prefetch skipped, device busy\n");
+		return;
+	}
+	/* an interrupted download waiting for resume is left alone */
+	if (dfudev->resume <= 0 && dfu_session_start(dfudev) == 0) {
+		uc = dfu_uc_load(dfudev);
+		if (uc) {
+			dev_info(&dfudev->intf->dev,
+				"Prefetched %zu bytes\n", uc->len);
+			dfu_uc_put(uc);
+		}
+		dfu_session_end(dfudev);
+	}
+	dfu_unclaim(dfudev);
+}
+
+static ssize_t dfu_prefetch_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+	struct dfu_upcache *uc;
+	ssize_t numb;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	uc = dfu_uc_get(dfudev);
+	if (!uc)
+		return sprintf(buf, "none\n");
+	numb = sprintf(buf, "%zu %u\n", uc->len, uc->gen);
+	dfu_uc_put(uc);
+	return numb;
+}
+
+static ssize_t dfu_prefetch_store(struct device *dev,
+			struct device_attribute *attr, const char *buf,
+			size_t count)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	if (count < 1 || *buf != '1')
+		return -EINVAL;
+	if (!dfudev->usbdev->serial || upload_cache <= 0)
+		return -EOPNOTSUPP;
+	queue_work(dfu_wq, &dfudev->pwork);
+	return count;
+}
+
+static ssize_t dfu_progress_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%zu %zu\n", READ_ONCE(dfudev->prog_done),
+			READ_ONCE(dfudev->prog_total));
+}
+
 static ssize_t dfu_state_show(struct device *dev, struct device_attribute *attr,
 			char *buf)
 {
@@ -482,24 +3482,46 @@ static ssize_t dfu_state_show(struct device *dev, struct device_attribute *attr,
 	struct dfu_control *ctrl;
 	int dfstat;
 
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	dfstat = READ_ONCE(dfudev->stats.state);
+	if (dfstat >= 0)
+		return sprintf(buf, "%d\n", dfstat);
+
+	ctrl = dfu_ctrl_get(dfudev);
 	if (!ctrl)
-		return -ENOMEM;
-	dfudev = container_of(attr, struct dfu1_device, statattr);
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
-		return -ENOMEM;
-	}
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
+		return -ERESTARTSYS;
 	dfstat = dfu_get_state(ctrl);
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_ctrl_put(dfudev, ctrl);
 	return sprintf(buf, "%d\n", dfstat);
 }
 
+static ssize_t dfu_status_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	return sprintf(buf, "%d\n", READ_ONCE(dfudev->stats.status));
+}
+
+/*
+ * Called after a GETSTATUS or GETSTATE saw a new state or status, wakes
+ * up poll() on the state and status files and the session's eventfd.
+ */
+static void dfu_state_notify(struct dfu_stats *stats)
+{
+	struct dfu1_device *dfudev;
+	unsigned long flags;
+
+	dfudev = container_of(stats, struct dfu1_device, stats);
+	sysfs_notify(&dfudev->intf->dev.kobj, NULL, "state");
+	sysfs_notify(&dfudev->intf->dev.kobj, NULL, "status");
+	spin_lock_irqsave(&dfudev->evlock, flags);
+	if (dfudev->evctx)
+		eventfd_signal(dfudev->evctx, 1);
+	spin_unlock_irqrestore(&dfudev->evlock, flags);
+}
+
 static ssize_t stellaris_show(struct dfu1_device *dfudev,
 			struct dfu_control *ctrl, char *buf)
 {
@@ -533,30 +3555,17 @@ static ssize_t dfu_query_show(struct device *dev, struct device_attribute *attr,
 {
 	struct dfu1_device *dfudev;
 	struct dfu_control *ctrl;
-	unsigned short idVendor, idProduct;
 	ssize_t numbytes;
 
-	dfudev = container_of(attr, struct dfu1_device, queryattr);
-	idVendor = le16_to_cpu(dfudev->usbdev->descriptor.idVendor);
-	idProduct = le16_to_cpu(dfudev->usbdev->descriptor.idProduct);
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
+	ctrl = dfu_ctrl_get(dfudev);
 	if (!ctrl)
-		return -ENOMEM;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
-		return -ENOMEM;
-	}
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
+		return -ERESTARTSYS;
 	numbytes = 0;
-	if (idVendor == USB_VENDOR_LUMINARY &&
-	    idProduct == USB_PRODUCT_STELLARIS_DFU)
+	if (dfu_is_stellaris(dfudev))
 		numbytes = stellaris_show(dfudev, ctrl, buf);
 
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_ctrl_put(dfudev, ctrl);
 	return numbytes;
 }
 
@@ -567,24 +3576,19 @@ static ssize_t dfu_clear_cmd(struct device *dev, struct device_attribute *attr,
 	struct dfu_control *ctrl;
 	int dfust;
 
-	dfudev = container_of(attr, struct dfu1_device, abortattr);
+	dfudev = usb_get_intfdata(to_usb_interface(dev));
 	if (count < 1 || *buf != '1') {
 		dev_warn(&dfudev->intf->dev, "Invalid command: %c\n", *buf);
 		return count;
 	}
 
-	ctrl = kmalloc(sizeof(struct dfu_control), GFP_KERNEL);
-	if (!ctrl)
-		return -ENOMEM;
-	ctrl->dfurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ctrl->dfurb) {
-		kfree(ctrl);
-		return -ENOMEM;
+	if (dfu_claim(dfudev, DFU_CLAIM_TRY))
+		return -EBUSY;
+	ctrl = dfu_ctrl_get(dfudev);
+	if (!ctrl) {
+		dfu_unclaim(dfudev);
+		return -ERESTARTSYS;
 	}
-
-	ctrl->usbdev = dfudev->usbdev;
-	ctrl->intf = dfudev->intf;
-	ctrl->intfnum = dfudev->intfnum;
 	dfust = dfu_get_state(ctrl);
 	switch (dfust) {
 	case dfuDNLOAD_IDLE:
@@ -599,124 +3603,188 @@ static ssize_t dfu_clear_cmd(struct device *dev, struct device_attribute *attr,
 				dfust);
 		break;
 	}
-	usb_free_urb(ctrl->dfurb);
-	kfree(ctrl);
+	dfu_ctrl_put(dfudev, ctrl);
+	dfu_unclaim(dfudev);
 	return count;
 }
 
-static int dfu_create_attrs(struct dfu1_device *dfudev)
+static struct device_attribute dfu_attr_dfucmd =
+	__ATTR(dfucmd, 0200, NULL, dfu_sndcmd);
+static struct device_attribute dfu_attr_attr =
+	__ATTR(attr, 0444, dfu_attr_show, NULL);
+static struct device_attribute dfu_attr_timeout =
+	__ATTR(timeout, 0444, dfu_timeout_show, NULL);
+static struct device_attribute dfu_attr_xfersize =
+	__ATTR(xfersize, 0644, dfu_xfersize_show, dfu_xfersize_store);
+static struct device_attribute dfu_attr_state =
+	__ATTR(state, 0444, dfu_state_show, NULL);
+static struct device_attribute dfu_attr_status =
+	__ATTR(status, 0444, dfu_status_show, NULL);
+static struct device_attribute dfu_attr_clear =
+	__ATTR(clear, 0200, NULL, dfu_clear_cmd);
+static struct device_attribute dfu_attr_query =
+	__ATTR(query, 0444, dfu_query_show, NULL);
+static struct device_attribute dfu_attr_fast_upload =
+	__ATTR(fast_upload, 0644, dfu_fastup_show, dfu_fastup_store);
+static struct device_attribute dfu_attr_progress =
+	__ATTR(progress, 0444, dfu_progress_show, NULL);
+static struct device_attribute dfu_attr_flash_firmware =
+	__ATTR(flash_firmware, 0644, dfu_flashfw_show, dfu_flashfw_store);
+static struct device_attribute dfu_attr_switch_time =
+	__ATTR(switch_time, 0444, dfu_switch_show, NULL);
+static struct device_attribute dfu_attr_resume =
+	__ATTR(resume, 0444, dfu_resume_show, NULL);
+static struct device_attribute dfu_attr_digest =
+	__ATTR(digest, 0444, dfu_digest_show, NULL);
+static struct device_attribute dfu_attr_prefetch =
+	__ATTR(prefetch, 0644, dfu_prefetch_show, dfu_prefetch_store);
+static struct device_attribute dfu_attr_alt =
+	__ATTR(alt, 0644, dfu_alt_show, dfu_alt_store);
+static struct device_attribute dfu_attr_alts =
+	__ATTR(alts, 0444, dfu_alts_show, NULL);
+
+static struct attribute *dfu_attrs[] = {
+	&dfu_attr_dfucmd.attr,
+	&dfu_attr_attr.attr,
+	&dfu_attr_timeout.attr,
+	&dfu_attr_xfersize.attr,
+	&dfu_attr_state.attr,
+	&dfu_attr_status.attr,
+	&dfu_attr_clear.attr,
+	&dfu_attr_query.attr,
+	&dfu_attr_fast_upload.attr,
+	&dfu_attr_progress.attr,
+	&dfu_attr_flash_firmware.attr,
+	&dfu_attr_switch_time.attr,
+	&dfu_attr_resume.attr,
+	&dfu_attr_digest.attr,
+	&dfu_attr_alt.attr,
+	&dfu_attr_alts.attr,
+	&dfu_attr_prefetch.attr,
+	NULL
+};
+
+static const struct attribute_group dfu_attr_group = {
+	.attrs = dfu_attrs,
+};
+
+static struct dentry *dfu_dbgroot;
+
+static const char * const dfu_reqnames[DFU_NREQS] = {
+	"DETACH", "DNLOAD", "UPLOAD", "GETSTATUS", "CLRSTATUS", "GETSTATE",
+	"ABORT", "VENDOR"
+};
+
+static int dfu_stats_show(struct seq_file *m, void *v)
 {
-	int retv = 0;
+	struct dfu1_device *dfudev;
+	struct dfu_stats *st;
+	struct dfu_reqstats *rst;
+	int i, j;
 
-	dfudev->tachattr.attr.name = "dfucmd";
-	dfudev->tachattr.attr.mode = 0200;
-	dfudev->tachattr.show = NULL;
-	dfudev->tachattr.store = dfu_sndcmd;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->tachattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		return retv;
-	}
-	dfudev->attrattr.attr.name = "attr";
-	dfudev->attrattr.attr.mode = 0444;
-	dfudev->attrattr.show = dfu_attr_show;
-	dfudev->attrattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->attrattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_10;
-	}
-	dfudev->tmoutattr.attr.name = "timeout";
-	dfudev->tmoutattr.attr.mode = 0444;
-	dfudev->tmoutattr.show = dfu_timeout_show;
-	dfudev->tmoutattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->tmoutattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_20;
-	}
-	dfudev->xsizeattr.attr.name = "xfersize";
-	dfudev->xsizeattr.attr.mode = 0444;
-	dfudev->xsizeattr.show = dfu_xfersize_show;
-	dfudev->xsizeattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->xsizeattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_30;
-	}
-	dfudev->statattr.attr.name = "state";
-	dfudev->statattr.attr.mode = 0444;
-	dfudev->statattr.show = dfu_state_show;
-	dfudev->statattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->statattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_40;
-	}
-	dfudev->abortattr.attr.name = "clear";
-	dfudev->abortattr.attr.mode = 0200;
-	dfudev->abortattr.store = dfu_clear_cmd;
-	dfudev->abortattr.show = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->abortattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_50;
-	}
-	dfudev->queryattr.attr.name = "query";
-	dfudev->queryattr.attr.mode =  0444;
-	dfudev->queryattr.show = dfu_query_show;
-	dfudev->queryattr.store = NULL;
-	retv = device_create_file(&dfudev->intf->dev, &dfudev->queryattr);
-	if (retv != 0) {
-		dev_err(&dfudev->intf->dev, "Cannot create sysfs file %d\n",
-				retv);
-		goto err_60;
+	dfudev = m->private;
+	st = kmalloc(sizeof(struct dfu_stats), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	spin_lock_irq(&dfudev->stats.lock);
+	memcpy(st, &dfudev->stats, sizeof(struct dfu_stats));
+	spin_unlock_irq(&dfudev->stats.lock);
+
+	seq_printf(m, "dnload: %llu bytes, %llu blocks\n",
+			st->dnload_bytes, st->dnload_blocks);
+	seq_printf(m, "upload: %llu bytes, %llu blocks\n",
+			st->upload_bytes, st->upload_blocks);
+	seq_printf(m, "busy: %llu us total, %u us max, %llu polls\n",
+			st->busy_total_us, st->busy_max_us, st->busy_polls);
+	seq_printf(m, "timeouts: %llu, retries: %llu\n", st->timeouts,
+			st->retries);
+	seq_puts(m, "request    count    errors   avg_us   max_us  srtt_us "
+			"rttvar_us  histogram (log2 us)\n");
+	for (i = 0; i < DFU_NREQS; i++) {
+		rst = &st->req[i];
+		if (rst->count == 0)
+			continue;
+		seq_printf(m, "%-9s %8llu %8llu %8llu %8u %8u %9u ",
+				dfu_reqnames[i], rst->count, rst->errors,
+				div64_u64(rst->total_us, rst->count),
+				rst->max_us, rst->srtt_us, rst->rttvar_us);
+		for (j = 0; j < DFU_HIST_BUCKETS; j++)
+			seq_printf(m, " %u", rst->hist[j]);
+		seq_putc(m, '\n');
 	}
+	kfree(st);
+	return 0;
+}
 
-	return retv;
+static int dfu_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, dfu_stats_show, inode->i_private);
+}
 
-err_60:
-	device_remove_file(&dfudev->intf->dev, &dfudev->abortattr);
-err_50:
-	device_remove_file(&dfudev->intf->dev, &dfudev->statattr);
-err_40:
-	device_remove_file(&dfudev->intf->dev, &dfudev->xsizeattr);
-err_30:
-	device_remove_file(&dfudev->intf->dev, &dfudev->tmoutattr);
-err_20:
-	device_remove_file(&dfudev->intf->dev, &dfudev->attrattr);
-err_10:
-	device_remove_file(&dfudev->intf->dev, &dfudev->tachattr);
-	return retv;
+static ssize_t dfu_stats_reset(struct file *filp, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	struct dfu1_device *dfudev;
+
+	dfudev = ((struct seq_file *)filp->private_data)->private;
+	spin_lock_irq(&dfudev->stats.lock);
+	memset(&dfudev->stats.req, 0,
+		sizeof(struct dfu_stats) - offsetof(struct dfu_stats, req));
+	spin_unlock_irq(&dfudev->stats.lock);
+	return count;
 }
 
-static void dfu_remove_attrs(struct dfu1_device *dfudev)
+static const struct file_operations dfu_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dfu_stats_open,
+	.read		= seq_read,
+	.write		= dfu_stats_reset,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+/*
+ * Collect the DFU mode alternate settings of the interface. Their names
+ * are read on first use, so probe does no transfer on the bus.
+ */
+static int dfu_read_alts(struct dfu1_device *dfudev)
 {
-	device_remove_file(&dfudev->intf->dev, &dfudev->queryattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->abortattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->statattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->xsizeattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->tmoutattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->attrattr);
-	device_remove_file(&dfudev->intf->dev, &dfudev->tachattr);
+	struct usb_interface_descriptor *desc;
+	int i;
+
+	dfudev->alts = kcalloc(dfudev->intf->num_altsetting,
+				sizeof(struct dfu_alt), GFP_KERNEL);
+	if (!dfudev->alts)
+		return -ENOMEM;
+	dfudev->nalts = 0;
+	for (i = 0; i < dfudev->intf->num_altsetting; i++) {
+		desc = &dfudev->intf->altsetting[i].desc;
+		if (desc->bInterfaceClass != USB_CLASS_APP_SPEC ||
+		    desc->bInterfaceSubClass != USB_DFU_SUBCLASS ||
+		    desc->bInterfaceProtocol != USB_DFU_PROTO_DFUMODE)
+			continue;
+		dfudev->alts[dfudev->nalts].alt = desc->bAlternateSetting;
+		dfudev->alts[dfudev->nalts].istr = desc->iInterface;
+		dfudev->nalts++;
+	}
+	return 0;
 }
 
-static atomic_t dfu_index = ATOMIC_INIT(-1);
-static atomic_t *dev_minors;
+static void dfu_free_alts(struct dfu1_device *dfudev)
+{
+	int i;
+
+	for (i = 0; i < dfudev->nalts; i++)
+		kfree(dfudev->alts[i].name);
+	kfree(dfudev->alts);
+}
 
 static int dfu_probe(struct usb_interface *intf,
 			const struct usb_device_id *id)
 {
-	int retv, dfufdsc_len, index;
+	int retv, dfufdsc_len, minor;
 	struct dfu1_device *dfudev;
 	struct dfufdsc *dfufdsc;
-	int i;
 
 	retv = 0;
 	dfufdsc = (struct dfufdsc *)intf->cur_altsetting->extra;
@@ -726,47 +3794,98 @@ static int dfu_probe(struct usb_interface *intf,
 		dev_err(&intf->dev, "Invalid DFU functional descriptor\n");
 		return -ENODEV;
 	}
-	index = atomic_inc_return(&dfu_index);
-	if (!(index < max_dfus)) {
-		dev_err(&intf->dev, "Maximum supported USB DFU reached: %d\n",
-				max_dfus);
-		retv = -ENODEV;
-		goto err_05;
+	if (le16_to_cpu(dfufdsc->xfersize) == 0) {
+		dev_err(&intf->dev, "Invalid DFU transfer size 0\n");
+		return -ENODEV;
 	}
 	dfudev = kmalloc(sizeof(struct dfu1_device), GFP_KERNEL);
-	if (!dfudev) {
-		retv = -ENOMEM;
-		goto err_05;
-	}
+	if (!dfudev)
+		return -ENOMEM;
 	dfudev->download = (dfufdsc->attr & 0x01) ? 1 : 0;
 	dfudev->upload = (dfufdsc->attr & 0x02) ? 1 : 0;
 	dfudev->manifest = (dfufdsc->attr & 0x04) ? 1 : 0;
 	dfudev->detach = (dfufdsc->attr & 0x08) ? 1 : 0;
 	dfudev->dettmout = le16_to_cpu(dfufdsc->tmout);
-	dfudev->xfersize = le16_to_cpu(dfufdsc->xfersize);
+	dfudev->maxxfer = le16_to_cpu(dfufdsc->xfersize);
+	dfudev->xfersize = dfudev->maxxfer;
 	dfudev->intf = intf;
 	dfudev->usbdev = interface_to_usbdev(intf);
 	dfudev->intfnum = intf->cur_altsetting->desc.bInterfaceNumber;
 	dfudev->proto = 2;
-	if (dfudev->usbdev->bus->controller->dma_mask)
-		dfudev->dma = 1;
-	else
-		dfudev->dma = 0;
-	mutex_init(&dfudev->lock);
-
-	retv = dfu_create_attrs(dfudev);
+	dfudev->busy_us = 0;
+	dfudev->fastup = 0;
+	dfu_get_quirk(dfudev->usbdev, quirks, &dfudev->quirk);
+	if (le16_to_cpu(dfufdsc->ver) == 0x011a)
+		dfudev->quirk.flags |= DFU_QUIRK_DFUSE;
+	if (dfudev->quirk.flags) {
+		dev_info(&intf->dev, "Quirks: %x\n", dfudev->quirk.flags);
+		dfudev->fastup = !!(dfudev->quirk.flags & DFU_QUIRK_FASTUP);
+		if ((dfudev->quirk.flags & DFU_QUIRK_BIGXFER) &&
+				dfudev->quirk.maxxfer > dfudev->maxxfer) {
+			dfudev->maxxfer = min(dfudev->quirk.maxxfer, 0xffffU);
+			dfudev->xfersize = dfudev->maxxfer;
+		}
+	}
+	dfudev->prog_done = 0;
+	dfudev->prog_total = 0;
+	dfudev->fwimg = NULL;
+	dfudev->fwgroup = NULL;
+	dfudev->fwresult = 0;
+	mutex_init(&dfudev->stagelock);
+	dfudev->stage = NULL;
+	dfudev->switch_us = -1;
+	INIT_WORK(&dfudev->fwork, dfu_flash_work);
+	INIT_WORK(&dfudev->awork, dfu_async_work);
+	INIT_WORK(&dfudev->mwork, dfu_manifest_work);
+	INIT_DELAYED_WORK(&dfudev->rwork, dfu_resume_expire);
+	INIT_WORK(&dfudev->pwork, dfu_prefetch_work);
+	dfudev->resume = -1;
+	dfudev->dcrc = NULL;
+	dfudev->dcrc_n = 0;
+	dfudev->dsum_len = -1;
+	dfudev->upgen = atomic_inc_return(&dfu_upgen);
+	dfudev->ucbad = 0;
+	dfudev->ucskip = 0;
+	dfudev->manifesting = 0;
+	init_waitqueue_head(&dfudev->await);
+	dfudev->abuf = NULL;
+	dfudev->abusy = 0;
+	dfudev->adir = DFU_ASYNC_NONE;
+	dfudev->aerr = 0;
+	memset(&dfudev->stats, 0, sizeof(struct dfu_stats));
+	spin_lock_init(&dfudev->stats.lock);
+	dfudev->stats.state = -1;
+	dfudev->stats.status = -1;
+	dfudev->stats.notify = dfu_state_notify;
+	spin_lock_init(&dfudev->evlock);
+	dfudev->evctx = NULL;
+	mutex_init(&dfudev->pipelock);
+	dfudev->owned = 0;
+	init_waitqueue_head(&dfudev->ownwait);
+
+	retv = dfu_alloc_ctrls(dfudev);
 	if (retv)
 		goto err_10;
+	retv = dfu_read_alts(dfudev);
+	if (retv)
+		goto err_12;
+	usb_set_intfdata(intf, dfudev);
+	retv = sysfs_create_group(&intf->dev.kobj, &dfu_attr_group);
+	if (retv) {
+		dev_err(&intf->dev, "Cannot create sysfs files %d\n", retv);
+		goto err_14;
+	}
 
-        for (i = 0; i < max_dfus; i++)
-                if (!atomic_xchg(dev_minors+i, 1))
-                        break;
-	if (i == max_dfus) {
-		retv = -EINVAL;
-		dev_err(&dfudev->intf->dev, "No minor usable, Logic Error\n");
+	mutex_lock(&dfu_devlock);
+	minor = idr_alloc(&dfu_idr, NULL, 0, max_dfus, GFP_KERNEL);
+	mutex_unlock(&dfu_devlock);
+	if (minor < 0) {
+		retv = minor == -ENOSPC ? -ENODEV : minor;
+		dev_err(&intf->dev, "Maximum supported USB DFU reached: %d\n",
+				max_dfus);
 		goto err_15;
 	}
-        dfudev->devno = MKDEV(MAJOR(dfu_devno), i);
+	dfudev->devno = MKDEV(MAJOR(dfu_devno), minor);
 
 	cdev_init(&dfudev->cdev, &dfu_fops);
 	dfudev->cdev.owner = THIS_MODULE;
@@ -784,19 +3903,34 @@ static int dfu_probe(struct usb_interface *intf,
 		goto err_30;
 	}
 
-        usb_set_intfdata(intf, dfudev);
+	dfudev->probed = ktime_get();
+	mutex_lock(&dfu_devlock);
+	idr_replace(&dfu_idr, dfudev, minor);
+	hash_add(dfu_porttab, &dfudev->pnode,
+			dfu_porthash(dev_name(&dfudev->usbdev->dev)));
+	mutex_unlock(&dfu_devlock);
+	atomic_inc(&dfu_probegen);
+	wake_up_all(&dfu_probewq);
+	dfudev->dbgdir = debugfs_create_dir(dev_name(&intf->dev), dfu_dbgroot);
+	debugfs_create_file("stats", 0600, dfudev->dbgdir, dfudev,
+			&dfu_stats_fops);
 	return retv;
 
 err_30:
 	cdev_del(&dfudev->cdev);
 err_20:
-	atomic_set(dev_minors+MINOR(dfudev->devno), 0);
+	mutex_lock(&dfu_devlock);
+	idr_remove(&dfu_idr, minor);
+	mutex_unlock(&dfu_devlock);
 err_15:
-	dfu_remove_attrs(dfudev);
+	sysfs_remove_group(&intf->dev.kobj, &dfu_attr_group);
+err_14:
+	usb_set_intfdata(intf, NULL);
+	dfu_free_alts(dfudev);
+err_12:
+	dfu_free_ctrls(dfudev);
 err_10:
 	kfree(dfudev);
-err_05:
-	atomic_dec(&dfu_index);
 	return retv;
 }
 
@@ -805,13 +3939,32 @@ static void dfu_disconnect(struct usb_interface *intf)
 	struct dfu1_device *dfudev;
 
 	dfudev = usb_get_intfdata(intf);
+	sysfs_remove_group(&intf->dev.kobj, &dfu_attr_group);
 	usb_set_intfdata(intf, NULL);
+	debugfs_remove_recursive(dfudev->dbgdir);
+	mutex_lock(&dfu_devlock);
+	idr_replace(&dfu_idr, NULL, MINOR(dfudev->devno));
+	hash_del(&dfudev->pnode);
+	mutex_unlock(&dfu_devlock);
+	if (cancel_work_sync(&dfudev->fwork))
+		dfu_flash_done(dfudev, -ENODEV);
+	flush_work(&dfudev->mwork);
+	cancel_delayed_work_sync(&dfudev->rwork);
+	cancel_work_sync(&dfudev->pwork);
+	cancel_work_sync(&dfudev->awork);
+	vfree(dfudev->abuf);
+	dfudev->abuf = NULL;
+	if (dfudev->usbdev->serial)
+		dfu_uc_drop(dfudev->usbdev->serial);
 	device_destroy(dfu_class, dfudev->devno);
 	cdev_del(&dfudev->cdev);
-	atomic_set(dev_minors+MINOR(dfudev->devno), 0);
-	dfu_remove_attrs(dfudev);
+	mutex_lock(&dfu_devlock);
+	idr_remove(&dfu_idr, MINOR(dfudev->devno));
+	mutex_unlock(&dfu_devlock);
+	dfu_free_ctrls(dfudev);
+	dfu_free_alts(dfudev);
+	kfree(dfudev->dcrc);
 	kfree(dfudev);
-	atomic_dec(&dfu_index);
 }
 
 static struct usb_driver dfu_driver = {
@@ -819,12 +3972,17 @@ static struct usb_driver dfu_driver = {
 	.probe = dfu_probe,
 	.disconnect = dfu_disconnect,
 	.id_table = dfu_ids,
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
 static int __init usbdfu_init(void)
 {
-	int i, retv;
+	int retv;
 
+	if (max_dfus < 1 || max_dfus > MINORMASK + 1) {
+		pr_err("Invalid max_dfus: %d\n", max_dfus);
+		return -EINVAL;
+	}
 	retv = alloc_chrdev_region(&dfu_devno, 0, max_dfus, DFUDEV_NAME);
 	if (retv != 0) {
 		pr_err("Cannot allocate a char major number: %d\n", retv);
@@ -836,24 +3994,24 @@ static int __init usbdfu_init(void)
 		pr_err("Cannot create DFU class, Out of Memory!\n");
 		goto err_10;
 	}
-	dev_minors = kmalloc_array(max_dfus, sizeof(atomic_t), GFP_KERNEL);
-	if (!dev_minors) {
+	dfu_wq = alloc_workqueue(DFUDEV_NAME, WQ_UNBOUND, 0);
+	if (!dfu_wq) {
 		retv = -ENOMEM;
-		pr_err("Cannot allocate minor talbe, Out of Memory\n");
+		pr_err("Cannot allocate work queue, Out of Memory\n");
 		goto err_20;
 	}
-	for (i = 0; i < max_dfus; i++)
-		atomic_set(dev_minors+i, 0);
+	dfu_dbgroot = debugfs_create_dir(dfu_driver.name, NULL);
         retv = usb_register(&dfu_driver);
 	if (retv) {
 		pr_err("Cannot register USB DFU driver: %d\n", retv);
-		goto err_30;
+		goto err_40;
 	}
 
         return 0;
 
-err_30:
-	kfree(dev_minors);
+err_40:
+	debugfs_remove_recursive(dfu_dbgroot);
+	destroy_workqueue(dfu_wq);
 err_20:
 	class_destroy(dfu_class);
 err_10:
@@ -864,7 +4022,9 @@ err_10:
 static void __exit usbdfu_exit(void)
 {
 	usb_deregister(&dfu_driver);
-	kfree(dev_minors);
+	debugfs_remove_recursive(dfu_dbgroot);
+	destroy_workqueue(dfu_wq);
+	idr_destroy(&dfu_idr);
 	class_destroy(dfu_class);
 	unregister_chrdev_region(dfu_devno, max_dfus);
 }
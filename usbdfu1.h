@@ -9,34 +9,99 @@
  *
 */
 #include <linux/cdev.h>
+#include <linux/workqueue.h>
 #include "usbdfu.h"
 
+struct dfu_fwimage;
+struct dfu_fwgroup;
+
+/* a DFU mode alternate setting, a partition of the device */
+struct dfu_alt {
+	int alt;		/* bAlternateSetting */
+	int istr;		/* iInterface */
+	char *name;		/* its interface string, NULL until read */
+};
+
+#define DFU_NXFER	2	/* transfer buffers per open session */
+#define DFU_NSYSCTRL	2	/* controls shared by the sysfs handlers */
+
+#define DFU_ASYNC_NONE		0
+#define DFU_ASYNC_DNLOAD	1	/* write behind of abuf */
+#define DFU_ASYNC_UPLOAD	2	/* read ahead into abuf */
+
 struct dfu1_device {
-	struct mutex lock;
+	struct mutex pipelock;		/* one control transfer at a time */
+	unsigned long owned;		/* bit 0: a session owns the device */
+	wait_queue_head_t ownwait;
 	struct usb_device *usbdev;
 	struct usb_interface *intf;
 	struct device *sysdev;
-	struct device_attribute tachattr;
-	struct device_attribute attrattr;
-	struct device_attribute tmoutattr;
-	struct device_attribute xsizeattr;
-	struct device_attribute statattr;
-	struct device_attribute abortattr;
-	struct device_attribute queryattr;
 	struct {
 		unsigned int download:1;
 		unsigned int upload:1;
 		unsigned int manifest:1;
 		unsigned int detach:1;
+		unsigned int fastup:1;	/* skip GETSTATUS on full blocks */
 	};
-	struct dfu_control *opctrl, *stctrl;
-	void *datbuf;
+	struct dfu_control *opctrl[DFU_NXFER], *stctrl;
+	struct dfu_control *sysctrl[DFU_NSYSCTRL];
+	unsigned long sysmap;		/* sysctrl in use */
+	wait_queue_head_t syswait;
+	struct dfu_control *ctrlmem;
+	void *xferbuf[DFU_NXFER];	/* coherent bounce buffers */
+	dma_addr_t xferdma[DFU_NXFER];
+	u8 *utail;		/* rest of the last upload block */
+	int utoff, utlen;
+	loff_t utpos;		/* file position of utail + utoff */
+	int utend;		/* the upload ended with that block */
 	dev_t devno;
+	struct hlist_node pnode;	/* in dfu_porttab, by port path */
 	int dettmout;
-	int xfersize;
+	int xfersize;		/* current, blocks are numbered in it */
+	int maxxfer;		/* wTransferSize of the descriptor */
+	int buflen;
+	unsigned int busy_us;	/* learned DNLOAD_BUSY time */
+	size_t prog_done, prog_total;	/* flash progress in bytes */
+	struct work_struct fwork;
+	struct dfu_fwimage *fwimg;	/* image being flashed by fwork */
+	struct dfu_fwgroup *fwgroup;	/* flash group fwork belongs to */
+	struct mutex stagelock;		/* protects stage */
+	struct dfu_fwimage *stage;	/* mmap() staging area of the session */
+	unsigned int fwflags;
+	int fwslot;
+	int fwresult;
+	ktime_t probed;
+	s64 switch_us;		/* detach to probe, -1 if not switched */
+	struct dfu_stats stats;
+	struct dentry *dbgdir;
+	spinlock_t evlock;		/* protects evctx */
+	struct eventfd_ctx *evctx;	/* DFU_IOC_EVENTFD of the session */
+	struct work_struct awork;	/* nonblocking read/write */
+	wait_queue_head_t await;
+	void *abuf;
+	loff_t apos;		/* file position of abuf */
+	size_t alen;
+	int adir;		/* DFU_ASYNC_* */
+	int abusy;		/* awork in flight */
+	int aerr;
+	struct work_struct mwork;	/* manifestation after close */
+	int manifesting;		/* mwork queued, session not over */
+	loff_t resume;		/* acknowledged end of a stopped download */
+	struct delayed_work rwork;	/* aborts it if not resumed */
+	u32 *dcrc;		/* CRCs of the flash blocks, Tiva only */
+	unsigned int dcrc_first;	/* first flash block in dcrc */
+	unsigned int dcrc_n;	/* 0 if the flash may have changed */
+	u32 dsum;		/* running CRC32 of the download */
+	loff_t dsum_len;	/* bytes in dsum, -1 if not from offset 0 */
+	u32 upgen;		/* flash generation, new with every DNLOAD */
+	u32 ucbad;		/* generation whose upload did not fit */
+	int ucskip;		/* next upload answers a vendor command */
+	struct work_struct pwork;	/* upload cache prefetch */
+	struct dfu_quirk quirk;
+	struct dfu_alt *alts;
+	int nalts;
 	int proto;
 	int intfnum;
-	int dma;
 	struct cdev cdev;
 };
 #endif /* LINUX_USB_DFU_1_DSCAO__ */
@@ -0,0 +1,96 @@
+#ifndef LINUX_USB_DFU_IOCTL_DSCAO__
+#define LINUX_USB_DFU_IOCTL_DSCAO__
+/*
+ * usbdfu_ioctl.h
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * ioctl interface of /dev/dfu?, shared by the driver and user space tools
+ *
+*/
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DFU_IOC_MAGIC		'D'
+
+#define DFU_FLASH_VERIFY	0x01	/* read the image back after manifest */
+#define DFU_FLASH_MANIFEST	0x02	/* finish with the zero length DNLOAD */
+#define DFU_FLASH_FD		0x04	/* image is a file descriptor */
+#define DFU_FLASH_FLAGS		0x07
+
+struct dfu_flash {
+	__u64 image;	/* user address of the image, or a file descriptor */
+	__u64 len;	/* image length, 0 for the whole file with DFU_FLASH_FD */
+	__u32 flags;
+	__u32 resv;
+};
+
+struct dfu_progress {
+	__u64 done;	/* bytes downloaded and verified so far */
+	__u64 total;
+	__s32 state;	/* last DFU state seen */
+	__s32 status;	/* last DFU status seen */
+};
+
+/*
+ * DFU_IOC_COMMIT flashes from the staging area mapped by mmap() on the
+ * same file, with struct dfu_flash: image is the offset in the area.
+ * DFU_FLASH_STAGED does the same for a flash group.
+ */
+#define DFU_FLASH_STAGED	0x20
+#define DFU_COMMIT_FLAGS	(DFU_FLASH_VERIFY | DFU_FLASH_MANIFEST)
+
+/* flash one image to several /dev/dfu? at once */
+struct dfu_flash_group {
+	__u64 image;	/* as in struct dfu_flash */
+	__u64 len;
+	__u32 flags;
+	__u32 ndevs;	/* number of entries in minors and results */
+	__u64 minors;	/* user address of __u32 minors[ndevs] */
+	__u64 results;	/* user address of __s32 results[ndevs] */
+};
+
+/*
+ * Tiva/Stellaris only: erase and program just the 1KiB flash blocks that
+ * differ from the image, found by reading the flash back or by the CRCs
+ * the driver kept from the last such flash.
+ */
+#define DFU_DIFF_NOCACHE	0x08	/* read back even if CRCs are known */
+#define DFU_DIFF_FLAGS		(DFU_FLASH_FD | DFU_DIFF_NOCACHE)
+
+struct dfu_flash_diff {
+	__u64 image;	/* as in struct dfu_flash */
+	__u64 len;
+	__u32 flags;
+	__u32 addr;	/* flash address of the image, 1KiB aligned */
+	__u32 written;	/* out: blocks erased and programmed */
+	__u32 skipped;	/* out: blocks left as they were */
+};
+
+/* read the image back in the driver and compare CRC32s */
+struct dfu_verify {
+	__u64 len;	/* bytes downloaded from offset 0 */
+	__u32 crc;	/* CRC32 of them, as computed by zlib */
+	__u32 upcrc;	/* CRC32 of as many bytes read back */
+	__u32 match;	/* crc == upcrc */
+	__u32 resv;
+};
+
+/* DFU_IOC_DFUSE flashes a DfuSe (ST DFU 1.1a) image, with struct dfu_flash */
+#define DFU_DFUSE_LAZY		0x10	/* erase each sector as it is reached */
+#define DFU_DFUSE_FLAGS		(DFU_FLASH_FD | DFU_FLASH_MANIFEST | \
+				 DFU_DFUSE_LAZY)
+
+#define DFU_IOC_FLASH		_IOW(DFU_IOC_MAGIC, 1, struct dfu_flash)
+#define DFU_IOC_PROGRESS	_IOR(DFU_IOC_MAGIC, 2, struct dfu_progress)
+#define DFU_IOC_FLASH_GROUP	_IOW(DFU_IOC_MAGIC, 3, struct dfu_flash_group)
+/* signal an eventfd on DFU state changes while open, -1 to stop */
+#define DFU_IOC_EVENTFD		_IOW(DFU_IOC_MAGIC, 4, __s32)
+#define DFU_IOC_FLASH_DIFF	_IOWR(DFU_IOC_MAGIC, 5, struct dfu_flash_diff)
+#define DFU_IOC_VERIFY		_IOR(DFU_IOC_MAGIC, 6, struct dfu_verify)
+#define DFU_IOC_DFUSE		_IOW(DFU_IOC_MAGIC, 7, struct dfu_flash)
+/* select the alternate setting, the partition, to flash, in dfuIDLE */
+#define DFU_IOC_SET_ALT		_IOW(DFU_IOC_MAGIC, 8, __u32)
+#define DFU_IOC_COMMIT		_IOW(DFU_IOC_MAGIC, 9, struct dfu_flash)
+
+#endif /* LINUX_USB_DFU_IOCTL_DSCAO__ */
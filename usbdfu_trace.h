@@ -0,0 +1,109 @@
+/*
+ * usbdfu_trace.h
+ *
+ * Copyright (c) 2017 Dashi Cao        <dscao999@hotmail.com, caods1@lenovo.com>
+ *
+ * Tracepoints of the DFU control transfers and of the DFU state machine.
+ * usbdfu.o is linked into both modules, so each module creates the events
+ * in its own system, named by DFU_TRACE_SYSTEM.
+ *
+*/
+#undef TRACE_SYSTEM
+#ifdef DFU_TRACE_SYSTEM
+#define TRACE_SYSTEM DFU_TRACE_SYSTEM
+#else
+#define TRACE_SYSTEM dfusb
+#endif
+
+#if !defined(LINUX_USB_DFU_TRACE_DSCAO__) || defined(TRACE_HEADER_MULTI_READ)
+#define LINUX_USB_DFU_TRACE_DSCAO__
+
+#include <linux/tracepoint.h>
+#include "usbdfu.h"
+
+TRACE_EVENT(dfu_urb_submit,
+	TP_PROTO(struct dfu_control *ctrl),
+	TP_ARGS(ctrl),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(__u8, reqtype)
+		__field(__u8, req)
+		__field(__u16, block)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->busnum = ctrl->usbdev->bus->busnum;
+		__entry->devnum = ctrl->usbdev->devnum;
+		__entry->reqtype = ctrl->req.bRequestType;
+		__entry->req = ctrl->req.bRequest;
+		__entry->block = le16_to_cpu(ctrl->req.wValue);
+		__entry->len = ctrl->len;
+	),
+	TP_printk("%03d:%03d type %02x req %u block %u len %d",
+		__entry->busnum, __entry->devnum, __entry->reqtype,
+		__entry->req, __entry->block, __entry->len)
+);
+
+TRACE_EVENT(dfu_urb_done,
+	TP_PROTO(struct dfu_control *ctrl, s64 usec),
+	TP_ARGS(ctrl, usec),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(__u8, reqtype)
+		__field(__u8, req)
+		__field(__u16, block)
+		__field(int, len)
+		__field(int, nxfer)
+		__field(int, status)
+		__field(s64, usec)
+	),
+	TP_fast_assign(
+		__entry->busnum = ctrl->usbdev->bus->busnum;
+		__entry->devnum = ctrl->usbdev->devnum;
+		__entry->reqtype = ctrl->req.bRequestType;
+		__entry->req = ctrl->req.bRequest;
+		__entry->block = le16_to_cpu(ctrl->req.wValue);
+		__entry->len = ctrl->len;
+		__entry->nxfer = ctrl->nxfer;
+		__entry->status = ctrl->status;
+		__entry->usec = usec;
+	),
+	TP_printk("%03d:%03d type %02x req %u block %u len %d/%d "
+		"status %d %lld us",
+		__entry->busnum, __entry->devnum, __entry->reqtype,
+		__entry->req, __entry->block, __entry->nxfer, __entry->len,
+		__entry->status, __entry->usec)
+);
+
+/* bStatus is -1 when the state came from a GETSTATE */
+TRACE_EVENT(dfu_state,
+	TP_PROTO(struct dfu_control *ctrl, int from, int to, int bstatus),
+	TP_ARGS(ctrl, from, to, bstatus),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(int, from)
+		__field(int, to)
+		__field(int, bstatus)
+	),
+	TP_fast_assign(
+		__entry->busnum = ctrl->usbdev->bus->busnum;
+		__entry->devnum = ctrl->usbdev->devnum;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->bstatus = bstatus;
+	),
+	TP_printk("%03d:%03d state %d -> %d status %d",
+		__entry->busnum, __entry->devnum, __entry->from,
+		__entry->to, __entry->bstatus)
+);
+
+#endif /* LINUX_USB_DFU_TRACE_DSCAO__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbdfu_trace
+#include <trace/define_trace.h>